@@ -0,0 +1,123 @@
+#ifndef _async_hpp
+#define _async_hpp
+
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+namespace Async {
+    typedef std::function<void()> Task;
+
+    /// Background threads draining a FIFO of tasks.
+    ///
+    /// With more than one thread tasks start in order but may finish out of
+    /// order; callers that care (like Record::Recorder) put results back in
+    /// order themselves.
+    struct Pool {
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<Task> queue;
+        size_t running = 0;
+        bool stopping = false;
+        std::vector<std::thread> threads;
+
+        Pool(size_t count) {
+            for (size_t i = 0; i < std::max<size_t>(count, 1); i += 1) {
+                threads.emplace_back([this](){ run(); });
+            }
+        }
+
+        /// Drains whatever is still queued, then joins.
+        ~Pool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            condition.notify_all();
+            for (auto &thread: threads) {
+                thread.join();
+            }
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Pool(Pool const&) = delete;
+        Pool& operator=(Pool const&) = delete;
+
+        void post(Task task) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back(std::move(task));
+            }
+            condition.notify_one();
+        }
+
+        /// Tasks queued or currently executing.
+        size_t pending() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return queue.size() + running;
+        }
+
+        size_t size() {
+            return threads.size();
+        }
+
+        /// Runs body(0) to body(parts - 1) on the pool, with the calling
+        /// thread taking part 0, and returns once they've all finished.
+        void parallel(size_t parts, const std::function<void(size_t)> &body) {
+            struct Batch {
+                std::mutex mutex;
+                std::condition_variable finished;
+                size_t remaining;
+            };
+            auto batch = std::make_shared<Batch>();
+            batch->remaining = parts > 1 ? parts - 1 : 0;
+            for (size_t part = 1; part < parts; part += 1) {
+                post([batch, &body, part]() {
+                    body(part);
+                    std::lock_guard<std::mutex> lock(batch->mutex);
+                    if (--batch->remaining == 0) {
+                        batch->finished.notify_one();
+                    }
+                });
+            }
+            if (parts > 0) {
+                body(0);
+            }
+            std::unique_lock<std::mutex> lock(batch->mutex);
+            batch->finished.wait(lock, [&batch](){ return batch->remaining == 0; });
+        }
+
+    private:
+        void run() {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                condition.wait(lock, [this](){ return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                auto task = std::move(queue.front());
+                queue.pop_front();
+                running += 1;
+                lock.unlock();
+                task();
+                lock.lock();
+                running -= 1;
+            }
+        }
+    };
+
+    /// A single background thread draining a FIFO of tasks.
+    ///
+    /// Used to get slow work (encoding, disk I/O) off of the libuvc and
+    /// libsoundio callback threads: those threads only ever post().
+    struct Worker: Pool {
+        Worker(): Pool(1) {}
+    };
+}
+
+#endif // _async_hpp
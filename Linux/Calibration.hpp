@@ -0,0 +1,307 @@
+#ifndef _calibration_hpp
+#define _calibration_hpp
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring> // memcpy
+#include <algorithm>
+#include <stdexcept>
+
+#include <soundio/soundio.h>
+
+namespace Calibration {
+    typedef std::chrono::steady_clock Clock;
+
+    inline bool supportsFormat(SoundIoFormat format) {
+        switch (format) {
+            case SoundIoFormatS8:
+            case SoundIoFormatU8:
+            case SoundIoFormatS16NE:
+            case SoundIoFormatS24NE:
+            case SoundIoFormatS32NE:
+            case SoundIoFormatFloat32NE:
+            case SoundIoFormatFloat64NE:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    inline float readSample(const char *p, SoundIoFormat format) {
+        switch (format) {
+            case SoundIoFormatS8: return *(const int8_t*)p / 128.0f;
+            case SoundIoFormatU8: return (*(const uint8_t*)p - 128) / 128.0f;
+            case SoundIoFormatS16NE: { int16_t v; memcpy(&v, p, 2); return v / 32768.0f; }
+            case SoundIoFormatS24NE: { int32_t v; memcpy(&v, p, 4); v = (int32_t)((uint32_t)v << 8) >> 8; return v / 8388608.0f; }
+            case SoundIoFormatS32NE: { int32_t v; memcpy(&v, p, 4); return v / 2147483648.0f; }
+            case SoundIoFormatFloat32NE: { float v; memcpy(&v, p, 4); return v; }
+            case SoundIoFormatFloat64NE: { double v; memcpy(&v, p, 8); return v; }
+            default: return 0;
+        }
+    }
+
+    inline void writeSample(char *p, SoundIoFormat format, float sample) {
+        sample = std::max(-1.0f, std::min(sample, 0.999f));
+        switch (format) {
+            case SoundIoFormatS8: *(int8_t*)p = sample * 128; break;
+            case SoundIoFormatU8: *(uint8_t*)p = sample * 128 + 128; break;
+            case SoundIoFormatS16NE: { int16_t v = sample * 32768; memcpy(p, &v, 2); break; }
+            case SoundIoFormatS24NE: { int32_t v = sample * 8388608; memcpy(p, &v, 4); break; }
+            case SoundIoFormatS32NE: { int32_t v = sample * 2147483648.0; memcpy(p, &v, 4); break; }
+            case SoundIoFormatFloat32NE: memcpy(p, &sample, 4); break;
+            case SoundIoFormatFloat64NE: { double v = sample; memcpy(p, &v, 8); break; }
+            default: break;
+        }
+    }
+
+    /// 1023 sample maximum length sequence of +-1 (x^10 + x^7 + 1): flat
+    /// spectrum and a single sharp autocorrelation peak, so it survives a
+    /// noisy loopback.
+    inline std::vector<float> mls() {
+        const int order = 10;
+        const uint32_t taps = 0x9;
+        uint32_t state = 1;
+        std::vector<float> sequence((1 << order) - 1);
+        for (auto &value: sequence) {
+            value = (state & 1) ? 1.0f : -1.0f;
+            uint32_t bit = __builtin_parity(state & taps);
+            state = (state >> 1) | (bit << (order - 1));
+        }
+        return sequence;
+    }
+
+    /// Maps a stream's frame counter to steady_clock time. Each callback
+    /// contributes one estimate of when frame 0 was handed over; the median
+    /// is the mapping and the spread is the callback jitter.
+    struct Timeline {
+        static const size_t capacity = 4096;
+        double origins[capacity];
+        std::atomic<size_t> count{0};
+
+        void record(double now, uint64_t frame, int sampleRate) {
+            auto index = count.load(std::memory_order_relaxed);
+            if (index >= capacity) {
+                return;
+            }
+            origins[index] = now - (double)frame / sampleRate;
+            count.store(index + 1, std::memory_order_release);
+        }
+
+        double origin() {
+            std::vector<double> sorted(origins, origins + count.load(std::memory_order_acquire));
+            if (sorted.empty()) {
+                return 0;
+            }
+            std::sort(sorted.begin(), sorted.end());
+            return sorted[sorted.size() / 2];
+        }
+
+        /// Interquartile range of the per-callback estimates, in seconds.
+        double jitter() {
+            std::vector<double> sorted(origins, origins + count.load(std::memory_order_acquire));
+            if (sorted.size() < 4) {
+                return 0;
+            }
+            std::sort(sorted.begin(), sorted.end());
+            return sorted[sorted.size() * 3 / 4] - sorted[sorted.size() / 4];
+        }
+    };
+
+    struct Result {
+        std::vector<double> latencies; // seconds, one per detected burst
+        int bursts = 0;
+        double mean = 0;
+        double jitter = 0; // standard deviation across bursts
+        double callbackJitter = 0;
+    };
+
+    /// Plays `bursts` MLS bursts on channel 0 of an output stream, records
+    /// channel 0 of an input stream and finds each burst in the recording by
+    /// normalized cross-correlation.
+    ///
+    /// Latency is measured from the time a sample was handed to libsoundio to
+    /// the time it was handed back, i.e. everything between the two
+    /// callbacks: output buffering, the converter chain and the loopback
+    /// itself, and input buffering. Hook the callbacks up with
+    /// `stream->userdata = &probe` and the static trampolines below.
+    struct Probe {
+        SoundIoFormat format;
+        int sampleRate;
+        int spacing;
+        int bursts;
+        std::vector<float> reference;
+
+        Clock::time_point start = Clock::now();
+        std::atomic<uint64_t> written{0};
+        Timeline output;
+
+        std::vector<float> captured;
+        std::atomic<uint64_t> received{0};
+        Timeline input;
+
+        Probe(SoundIoFormat format, int sampleRate, int bursts = 8, double spacing = 0.5): format(format), sampleRate(sampleRate), spacing(spacing * sampleRate), bursts(bursts), reference(mls()) {
+            if (!supportsFormat(format)) {
+                throw std::runtime_error("Calibration needs a native-endian sample format.");
+            }
+            // One spare spacing before the first burst and after the last so
+            // the tail of the last burst is captured at any sane latency.
+            captured.resize((bursts + 2) * this->spacing);
+        }
+
+        ///This object is shared with realtime callbacks. this object is not copyable
+        Probe(Probe const&) = delete;
+        Probe& operator=(Probe const&) = delete;
+
+        double seconds() {
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+        bool done() {
+            return received.load() >= captured.size();
+        }
+
+        float sampleAt(uint64_t frame) {
+            if (frame < (uint64_t)spacing) {
+                return 0;
+            }
+            uint64_t offset = (frame - spacing) % spacing;
+            uint64_t burst = (frame - spacing) / spacing;
+            if (burst >= (uint64_t)bursts || offset >= reference.size()) {
+                return 0;
+            }
+            return 0.5f * reference[offset];
+        }
+
+        void write(SoundIoOutStream *outstream, int frameCountMin, int frameCountMax) {
+            int framesLeft = std::max(frameCountMin, std::min(frameCountMax, sampleRate / 100));
+            output.record(seconds(), written.load(std::memory_order_relaxed), sampleRate);
+            while (framesLeft > 0) {
+                int frameCount = framesLeft;
+                SoundIoChannelArea *areas;
+                if (soundio_outstream_begin_write(outstream, &areas, &frameCount) || frameCount <= 0) {
+                    return;
+                }
+                auto frame = written.load(std::memory_order_relaxed);
+                for (int i = 0; i < frameCount; i += 1) {
+                    float sample = sampleAt(frame + i);
+                    for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
+                        writeSample(areas[ch].ptr, format, ch == 0 ? sample : 0);
+                        areas[ch].ptr += areas[ch].step;
+                    }
+                }
+                soundio_outstream_end_write(outstream);
+                written.store(frame + frameCount, std::memory_order_relaxed);
+                framesLeft -= frameCount;
+            }
+        }
+
+        void read(SoundIoInStream *instream, int frameCountMin, int frameCountMax) {
+            int framesLeft = frameCountMax;
+            while (framesLeft > 0) {
+                int frameCount = framesLeft;
+                SoundIoChannelArea *areas;
+                if (soundio_instream_begin_read(instream, &areas, &frameCount) || frameCount <= 0) {
+                    break;
+                }
+                auto frame = received.load(std::memory_order_relaxed);
+                for (int i = 0; i < frameCount; i += 1) {
+                    if (frame + i < captured.size()) {
+                        captured[frame + i] = areas ? readSample(areas[0].ptr + i * areas[0].step, format) : 0;
+                    }
+                }
+                soundio_instream_end_read(instream);
+                received.store(frame + frameCount, std::memory_order_release);
+                framesLeft -= frameCount;
+            }
+            // Frame `received` is the newest one we have: map that to now.
+            input.record(seconds(), received.load(std::memory_order_relaxed), sampleRate);
+        }
+
+        static void writeCallback(SoundIoOutStream *outstream, int frameCountMin, int frameCountMax) {
+            ((Probe*)outstream->userdata)->write(outstream, frameCountMin, frameCountMax);
+        }
+
+        static void readCallback(SoundIoInStream *instream, int frameCountMin, int frameCountMax) {
+            ((Probe*)instream->userdata)->read(instream, frameCountMin, frameCountMax);
+        }
+
+        /// Normalized correlation peak of the reference within
+        /// captured[from, to). Returns the index, or -1 if nothing clears
+        /// `threshold`.
+        long find(size_t from, size_t to, std::vector<double> &energy, double threshold = 0.3) {
+            size_t length = reference.size();
+            to = std::min(to, captured.size() - length);
+            double best = threshold;
+            long bestIndex = -1;
+            for (size_t i = from; i < to; i += 1) {
+                double window = energy[i + length] - energy[i];
+                if (window <= 1e-9) {
+                    continue;
+                }
+                double sum = 0;
+                const float *x = &captured[i];
+                for (size_t k = 0; k < length; k += 1) {
+                    sum += x[k] * reference[k];
+                }
+                double score = std::fabs(sum) / std::sqrt(window * length);
+                if (score > best) {
+                    best = score;
+                    bestIndex = i;
+                }
+            }
+            return bestIndex;
+        }
+
+        Result analyze() {
+            Result result;
+            result.bursts = bursts;
+
+            std::vector<double> energy(captured.size() + 1, 0);
+            for (size_t i = 0; i < captured.size(); i += 1) {
+                energy[i + 1] = energy[i] + (double)captured[i] * captured[i];
+            }
+
+            double outOrigin = output.origin();
+            double inOrigin = input.origin();
+            result.callbackJitter = std::max(output.jitter(), input.jitter());
+
+            // Until a burst is found, search a whole spacing after it was sent
+            // (so latency has to be below the spacing); after that, only near
+            // where the previous one landed.
+            long lag = -1;
+            for (int burst = 0; burst < bursts; burst += 1) {
+                uint64_t sent = (uint64_t)(burst + 1) * spacing;
+                size_t from = sent, to = sent + spacing;
+                if (lag >= 0) {
+                    from = std::max<long>(sent, sent + lag - sampleRate / 10);
+                    to = sent + lag + sampleRate / 10;
+                }
+                auto index = find(from, to, energy);
+                if (index < 0) {
+                    continue;
+                }
+                lag = index - sent;
+                double sentAt = outOrigin + (double)sent / sampleRate;
+                double receivedAt = inOrigin + (double)index / sampleRate;
+                result.latencies.push_back(receivedAt - sentAt);
+            }
+
+            if (!result.latencies.empty()) {
+                for (auto latency: result.latencies) {
+                    result.mean += latency;
+                }
+                result.mean /= result.latencies.size();
+                for (auto latency: result.latencies) {
+                    result.jitter += (latency - result.mean) * (latency - result.mean);
+                }
+                result.jitter = std::sqrt(result.jitter / result.latencies.size());
+            }
+            return result;
+        }
+    };
+}
+
+#endif // _calibration_hpp
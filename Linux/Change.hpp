@@ -0,0 +1,153 @@
+#ifndef _change_hpp
+#define _change_hpp
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring> // memcpy
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Video {
+    /// 64-bit hash of a rectangle of bytes, `rows` rows of `rowBytes` each.
+    ///
+    /// An xxh3-style multiply-accumulate over 16 byte blocks with a key that
+    /// advances per block, so moving content around still changes the hash.
+    /// The SSE2 and scalar paths produce identical results.
+    inline uint64_t hashRect(const uint8_t *origin, size_t step, size_t rowBytes, int rows) {
+        const uint64_t prime = 0x9E3779B185EBCA87ull;
+        const uint64_t keyLo = 0xC2B2AE3D27D4EB4Full, keyHi = 0x165667B19E3779F9ull;
+        const uint64_t advance = 0x27D4EB2F165667C5ull;
+        uint64_t tail = 0;
+        uint64_t lanes[2];
+
+#ifdef __SSE2__
+        __m128i acc = _mm_setzero_si128();
+        __m128i key = _mm_set_epi64x(keyHi, keyLo);
+        const __m128i increment = _mm_set1_epi64x(advance);
+#else
+        uint64_t acc0 = 0, acc1 = 0;
+        uint64_t key0 = keyLo, key1 = keyHi;
+#endif
+
+        for (int row = 0; row < rows; row += 1) {
+            auto p = origin + row * step;
+            size_t i = 0;
+#ifdef __SSE2__
+            for (; i + 16 <= rowBytes; i += 16) {
+                __m128i data = _mm_loadu_si128((const __m128i*)(p + i));
+                __m128i mixed = _mm_xor_si128(data, key);
+                __m128i product = _mm_mul_epu32(mixed, _mm_shuffle_epi32(mixed, _MM_SHUFFLE(2, 3, 0, 1)));
+                acc = _mm_add_epi64(acc, _mm_add_epi64(product, _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))));
+                key = _mm_add_epi64(key, increment);
+            }
+#else
+            for (; i + 16 <= rowBytes; i += 16) {
+                uint64_t data0, data1;
+                memcpy(&data0, p + i, 8);
+                memcpy(&data1, p + i + 8, 8);
+                uint64_t mixed0 = data0 ^ key0, mixed1 = data1 ^ key1;
+                acc0 += (mixed0 & 0xFFFFFFFF) * (mixed0 >> 32) + data1;
+                acc1 += (mixed1 & 0xFFFFFFFF) * (mixed1 >> 32) + data0;
+                key0 += advance;
+                key1 += advance;
+            }
+#endif
+            for (; i < rowBytes; i += 1) {
+                tail = (tail ^ p[i]) * prime;
+            }
+        }
+
+#ifdef __SSE2__
+        _mm_storeu_si128((__m128i*)lanes, acc);
+#else
+        lanes[0] = acc0;
+        lanes[1] = acc1;
+#endif
+
+        // murmur3 finalizer so nearby inputs land far apart
+        uint64_t h = lanes[0] ^ (lanes[1] * prime) ^ tail ^ rowBytes ^ ((uint64_t)rows << 32);
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /// Splits packed 4:2:2 frames into tiles and remembers each tile's hash,
+    /// so unchanged frames (or unchanged parts of frames) can skip work.
+    ///
+    /// A full refresh is forced every `refreshInterval` frames to bound how
+    /// long a hash collision could leave a stale tile on screen.
+    struct ChangeDetector {
+        struct Tile {
+            int x0, x1, y0, y1;
+        };
+
+        int tileWidth;
+        int tileHeight;
+        int refreshInterval;
+
+        int width = 0;
+        int height = 0;
+        int columns = 0;
+        int rows = 0;
+        int sinceRefresh = 0;
+        std::vector<uint64_t> hashes;
+        std::vector<Tile> dirty;
+
+        ChangeDetector(int tileWidth = 128, int tileHeight = 16, int refreshInterval = 300): tileWidth(tileWidth), tileHeight(tileHeight), refreshInterval(refreshInterval) {}
+
+        int tileCount() {
+            return columns * rows;
+        }
+
+        /// Forget everything; the next frame is reported as entirely dirty.
+        void invalidate() {
+            width = 0;
+            height = 0;
+        }
+
+        /// Hashes every tile of a YUYV frame and collects the ones that
+        /// changed since the last call into `dirty`. Returns the dirty count.
+        int update(const uint8_t *data, size_t step, int frameWidth, int frameHeight) {
+            bool full = false;
+            if (frameWidth != width || frameHeight != height) {
+                width = frameWidth;
+                height = frameHeight;
+                columns = (width + tileWidth - 1) / tileWidth;
+                rows = (height + tileHeight - 1) / tileHeight;
+                hashes.assign(columns * rows, 0);
+                dirty.reserve(columns * rows);
+                full = true;
+            }
+            if (++sinceRefresh >= refreshInterval) {
+                sinceRefresh = 0;
+                full = true;
+            }
+
+            dirty.clear();
+            for (int row = 0; row < rows; row += 1) {
+                int y0 = row * tileHeight;
+                int y1 = std::min(y0 + tileHeight, height);
+                for (int column = 0; column < columns; column += 1) {
+                    int x0 = column * tileWidth;
+                    int x1 = std::min(x0 + tileWidth, width);
+                    auto hash = hashRect(data + y0 * step + x0 * 2, step, (x1 - x0) * 2, y1 - y0);
+                    auto &stored = hashes[row * columns + column];
+                    if (full || hash != stored) {
+                        stored = hash;
+                        dirty.push_back({x0, x1, y0, y1});
+                    }
+                }
+            }
+            return dirty.size();
+        }
+    };
+}
+
+#endif // _change_hpp
@@ -0,0 +1,687 @@
+#ifndef _codec_hpp
+#define _codec_hpp
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring> // memcpy
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/// Lossless intra-frame compression for packed YUYV.
+///
+/// Every byte is predicted from its neighbours of the same component: Y from
+/// the Y two bytes to the left, U and V from the U or V four bytes to the
+/// left, and the same positions one row up. Each row picks whichever of
+/// three predictors fits it best:
+///
+/// * left: the neighbour to the left
+/// * up: the byte above
+/// * gradient: left + up - up-left
+///
+/// All three undo with plain additions: up is one add per byte, left and
+/// gradient a running sum along the row (plus up, for gradient). Unlike a
+/// median predictor nothing depends on a comparison with the byte just
+/// decoded, so decoding runs 16 bytes at a time with SSE2. Outside the frame
+/// counts as zero.
+///
+/// Residuals are zigzagged so small corrections in either direction become
+/// small numbers, then Rice coded in blocks of 32 with the parameter picked
+/// per block. A 4 bit code leads each block: 0 for all zeroes, 1 to 8 for
+/// Rice with k = code - 1, 15 for the block stored as is. A Rice block isn't
+/// stored value by value but in three parts: the low k bits of every value,
+/// a bit per value saying whether its quotient is nonzero, and the nonzero
+/// quotients less one in unary. That's the same number of bits, but the
+/// first two parts pack and unpack 16 values at a time and the last is one
+/// pass over set bits, rather than a chain of variable-length reads each
+/// waiting on the one before. Each row starts with its predictor byte and
+/// ends on a byte boundary, so rows are independent and a bad row can't
+/// spill over.
+namespace Codec {
+    static const size_t blockValues = 32;
+
+    enum Predictor: uint8_t {
+        Left = 0,
+        Up = 1,
+        Gradient = 2,
+    };
+
+    enum BlockCode {
+        Zero = 0,
+        Raw = 15,
+    };
+
+    /// The most compress() can write for `rows` rows of `rowBytes`.
+    inline size_t bound(size_t rowBytes, int rows) {
+        size_t blocks = (rowBytes + blockValues - 1) / blockValues;
+        return rows * (1 + rowBytes + (blocks + 1) / 2 + 1) + 8;
+    }
+
+    /// Distance to the previous byte of the same component.
+    inline size_t leftOffset(size_t position) {
+        return (position & 1) ? 4 : 2;
+    }
+
+    inline uint8_t zigzag(uint8_t residual) {
+        return (uint8_t)(residual << 1) ^ (uint8_t)((int8_t)residual >> 7);
+    }
+
+    inline uint8_t unzigzag(uint8_t value) {
+        return (value >> 1) ^ (uint8_t)-(value & 1);
+    }
+
+    inline uint8_t predict(Predictor predictor, const uint8_t *row, const uint8_t *up, size_t position) {
+        auto offset = leftOffset(position);
+        int a = position >= offset ? row[position - offset] : 0;
+        if (predictor == Left) {
+            return a;
+        }
+        if (predictor == Up) {
+            return up[position];
+        }
+        int c = position >= offset ? up[position - offset] : 0;
+        return a + up[position] - c;
+    }
+
+    /// Zigzagged residuals of row[x, x + count) into out. Zero pads to 16.
+    inline void residuals(Predictor predictor, const uint8_t *row, const uint8_t *up, size_t x, size_t count, uint8_t *out) {
+#ifdef __SSE2__
+        if (x >= 16 && count == 16) {
+            // Even bytes are Y, whose left neighbour is 2 back; odd are U/V, 4 back.
+            const __m128i odd = _mm_set1_epi16((short)0xFF00);
+            const __m128i zero = _mm_setzero_si128();
+            auto left = [&](const uint8_t *p) {
+                auto two = _mm_loadu_si128((const __m128i *)(p + x - 2));
+                auto four = _mm_loadu_si128((const __m128i *)(p + x - 4));
+                return _mm_or_si128(_mm_and_si128(odd, four), _mm_andnot_si128(odd, two));
+            };
+
+            auto residual = _mm_loadu_si128((const __m128i *)(row + x));
+            if (predictor == Left) {
+                residual = _mm_sub_epi8(residual, left(row));
+            } else {
+                residual = _mm_sub_epi8(residual, _mm_loadu_si128((const __m128i *)(up + x)));
+                if (predictor == Gradient) {
+                    residual = _mm_sub_epi8(residual, _mm_sub_epi8(left(row), left(up)));
+                }
+            }
+            auto sign = _mm_cmpgt_epi8(zero, residual);
+            _mm_storeu_si128((__m128i *)out, _mm_xor_si128(_mm_add_epi8(residual, residual), sign));
+            return;
+        }
+#endif
+        for (size_t i = 0; i < count; i += 1) {
+            out[i] = zigzag(row[x + i] - predict(predictor, row, up, x + i));
+        }
+        memset(out + count, 0, 16 - count);
+    }
+
+    /// The predictor with the smallest sum of zigzagged residuals over a
+    /// row, which is close enough to what it will code to.
+    inline Predictor choose(const uint8_t *row, const uint8_t *up, size_t rowBytes) {
+        static const Predictor predictors[] = {Left, Up, Gradient};
+        uint64_t totals[3] = {0, 0, 0};
+        auto chunk = [&](size_t x, size_t count) {
+            uint8_t values[16];
+            for (int i = 0; i < 3; i += 1) {
+                residuals(predictors[i], row, up, x, count, values);
+                for (size_t j = 0; j < count; j += 1) {
+                    totals[i] += values[j];
+                }
+            }
+        };
+
+        size_t x = 0;
+#ifdef __SSE2__
+        if (rowBytes >= 32) {
+            chunk(0, 16);
+            // residuals() for all three at once, sharing the loads.
+            const __m128i odd = _mm_set1_epi16((short)0xFF00);
+            const __m128i zero = _mm_setzero_si128();
+            auto left = [&](const uint8_t *p) {
+                auto two = _mm_loadu_si128((const __m128i *)(p + x - 2));
+                auto four = _mm_loadu_si128((const __m128i *)(p + x - 4));
+                return _mm_or_si128(_mm_and_si128(odd, four), _mm_andnot_si128(odd, two));
+            };
+            auto magnitude = [&](__m128i residual) {
+                auto zigzagged = _mm_xor_si128(_mm_add_epi8(residual, residual), _mm_cmpgt_epi8(zero, residual));
+                return _mm_sad_epu8(zigzagged, zero);
+            };
+            __m128i sums[3] = {zero, zero, zero};
+            for (x = 16; x + 16 <= rowBytes; x += 16) {
+                auto current = _mm_loadu_si128((const __m128i *)(row + x));
+                auto fromLeft = _mm_sub_epi8(current, left(row));
+                auto fromUp = _mm_sub_epi8(current, _mm_loadu_si128((const __m128i *)(up + x)));
+                auto fromGradient = _mm_sub_epi8(fromUp, _mm_sub_epi8(left(row), left(up)));
+                sums[0] = _mm_add_epi64(sums[0], magnitude(fromLeft));
+                sums[1] = _mm_add_epi64(sums[1], magnitude(fromUp));
+                sums[2] = _mm_add_epi64(sums[2], magnitude(fromGradient));
+            }
+            for (int i = 0; i < 3; i += 1) {
+                totals[i] += _mm_cvtsi128_si64(sums[i]) + _mm_cvtsi128_si64(_mm_srli_si128(sums[i], 8));
+            }
+        }
+#endif
+        for (; x < rowBytes; x += 16) {
+            chunk(x, std::min<size_t>(16, rowBytes - x));
+        }
+
+        int best = 0;
+        for (int i = 1; i < 3; i += 1) {
+            if (totals[i] < totals[best]) {
+                best = i;
+            }
+        }
+        return predictors[best];
+    }
+
+    /// LSB first bit writer. Every put stores a whole word and moves on by
+    /// the bytes completed, so there's no branch on when to spill; it may
+    /// write up to 8 bytes past what it has used.
+    struct BitWriter {
+        uint8_t *out;
+        uint64_t bits = 0;
+        int count = 0;
+
+        BitWriter(uint8_t *out): out(out) {}
+
+        /// Appends `value`, which must fit in `length` bits; length is at
+        /// most 56.
+        void put(uint64_t value, int length) {
+            bits |= value << count;
+            count += length;
+            memcpy(out, &bits, 8);
+            out += count >> 3;
+            bits >>= count & ~7;
+            count &= 7;
+        }
+
+        /// `zeroes` zero bits and a one.
+        void unary(uint32_t zeroes) {
+            for (; zeroes >= 48; zeroes -= 48) {
+                put(0, 48);
+            }
+            put(1ull << zeroes, zeroes + 1);
+        }
+
+        /// Pads to a whole byte with zeroes and returns the end.
+        uint8_t* finish() {
+            if (count) {
+                *out++ = (uint8_t)bits;
+            }
+            bits = 0;
+            count = 0;
+            return out;
+        }
+    };
+
+    /// LSB first bit reader over the whole input. There's no state beyond
+    /// the position, so every read is an independent load; past the end it
+    /// reads zeroes, and overrun() says so.
+    struct BitReader {
+        const uint8_t *data;
+        size_t bytes;
+        uint64_t position = 0;
+
+        BitReader(const uint8_t *data, size_t bytes): data(data), bytes(bytes) {}
+
+        /// The next 56 bits.
+        uint64_t peek() {
+            auto byte = position >> 3;
+            uint64_t word;
+            if (byte + 8 <= bytes) {
+                memcpy(&word, data + byte, 8);
+            } else {
+                word = tail(byte);
+            }
+            return (word >> (position & 7)) & ((1ull << 56) - 1);
+        }
+
+        /// The last few bytes, kept out of peek() so it stays small enough
+        /// to inline everywhere.
+        uint64_t tail(size_t byte) {
+            uint64_t word = 0;
+            if (byte < bytes) {
+                memcpy(&word, data + byte, bytes - byte);
+            }
+            return word;
+        }
+
+        bool overrun() {
+            return position > bytes * 8;
+        }
+
+        /// Moves to the next byte boundary.
+        void align() {
+            position = (position + 7) & ~(uint64_t)7;
+        }
+    };
+
+    /// 1 << i, looked up. Without BMI2 a shift by a variable amount is
+    /// several uops on x86, and building a block's unary code takes 32.
+    struct Powers {
+        uint64_t bit[64];
+
+        constexpr Powers(): bit() {
+            for (int i = 0; i < 64; i += 1) {
+                bit[i] = 1ull << i;
+            }
+        }
+    };
+    inline constexpr Powers powers;
+
+    /// Sum of values >> k over a block, which is zero padded to 32.
+    inline uint32_t quotients(const uint8_t *values, size_t count, int k) {
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        auto shift = _mm_cvtsi32_si128(k);
+        auto mask = _mm_set1_epi8((char)(0xFF >> k));
+        auto sums = _mm_sad_epu8(_mm_and_si128(_mm_srl_epi16(_mm_loadu_si128((const __m128i *)values), shift), mask), zero);
+        if (count > 16) {
+            auto second = _mm_loadu_si128((const __m128i *)(values + 16));
+            sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_and_si128(_mm_srl_epi16(second, shift), mask), zero));
+        }
+        return _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+#else
+        uint32_t total = 0;
+        for (size_t i = 0; i < count; i += 1) {
+            total += values[i] >> k;
+        }
+        return total;
+#endif
+    }
+
+#ifdef __SSE2__
+    /// Packs 16 values of k bits into two 64 bit lanes of 8 values each, the
+    /// first value lowest: pairs into 16 bit lanes, then 32, then 64.
+    inline __m128i packBits(__m128i values, int k) {
+        values = _mm_or_si128(_mm_and_si128(values, _mm_set1_epi16(0xFF)),
+                              _mm_sll_epi16(_mm_srli_epi16(values, 8), _mm_cvtsi32_si128(k)));
+        values = _mm_or_si128(_mm_and_si128(values, _mm_set1_epi32(0xFFFF)),
+                              _mm_sll_epi32(_mm_srli_epi32(values, 16), _mm_cvtsi32_si128(2 * k)));
+        return _mm_or_si128(_mm_and_si128(values, _mm_set_epi32(0, -1, 0, -1)),
+                            _mm_sll_epi64(_mm_srli_epi64(values, 32), _mm_cvtsi32_si128(4 * k)));
+    }
+
+    /// Reverses packBits(). Bits above the 8k used in each lane must be zero.
+    inline __m128i unpackBits(__m128i packed, int k) {
+        auto mask = _mm_set1_epi64x((1ll << (4 * k)) - 1);
+        packed = _mm_or_si128(_mm_and_si128(packed, mask),
+                              _mm_slli_epi64(_mm_srl_epi64(packed, _mm_cvtsi32_si128(4 * k)), 32));
+        mask = _mm_set1_epi32((1 << (2 * k)) - 1);
+        packed = _mm_or_si128(_mm_and_si128(packed, mask),
+                              _mm_slli_epi32(_mm_srl_epi32(packed, _mm_cvtsi32_si128(2 * k)), 16));
+        mask = _mm_set1_epi16((1 << k) - 1);
+        return _mm_or_si128(_mm_and_si128(packed, mask),
+                            _mm_slli_epi16(_mm_srl_epi16(packed, _mm_cvtsi32_si128(k)), 8));
+    }
+#endif
+
+    /// Codes one block of zigzagged values.
+    inline void encodeBlock(const uint8_t *values, size_t count, BitWriter &writer) {
+        // Bits each k would take: count * (k + 1) plus the sum of the
+        // quotients. Blocks are zero padded, so the padding costs nothing.
+        auto zeroCost = quotients(values, count, 0);
+        if (zeroCost == 0) {
+            writer.put(Zero, 4);
+            return;
+        }
+        // The best k is close to log2 of the mean, so only look either side
+        // of that.
+        auto mean = zeroCost / count;
+        int guess = mean ? 31 - __builtin_clz(mean) : 0;
+        int best = -1;
+        size_t bestBits = count * 8;
+        uint32_t unaryBits = 0;
+        for (int k = std::max(guess - 1, 0); k <= std::min(guess + 1, 7); k += 1) {
+            auto sum = k ? quotients(values, count, k) : zeroCost;
+            size_t bits = count * (k + 1) + sum;
+            if (bits < bestBits) {
+                bestBits = bits;
+                best = k;
+                unaryBits = sum;
+            }
+        }
+
+        if (best < 0) {
+            writer.put(Raw, 4);
+            for (size_t i = 0; i < count; i += 4) {
+                auto group = std::min<size_t>(4, count - i);
+                uint32_t word = 0;
+                memcpy(&word, values + i, group);
+                writer.put(word, 8 * group);
+            }
+            return;
+        }
+        writer.put(best + 1, 4);
+#ifdef __SSE2__
+        if (best > 0 && count == blockValues) {
+            auto mask = _mm_set1_epi8((char)((1 << best) - 1));
+            for (size_t i = 0; i < count; i += 16) {
+                uint64_t words[2];
+                auto packed = packBits(_mm_and_si128(_mm_loadu_si128((const __m128i *)(values + i)), mask), best);
+                _mm_storeu_si128((__m128i *)words, packed);
+                writer.put(words[0], 8 * best);
+                writer.put(words[1], 8 * best);
+            }
+        } else
+#endif
+        if (best > 0) {
+            uint64_t mask = (1u << best) - 1;
+            for (size_t i = 0; i < count; i += 8) {
+                auto group = std::min<size_t>(8, count - i);
+                uint64_t word = 0;
+                for (size_t j = 0; j < group; j += 1) {
+                    word |= (values[i + j] & mask) << (j * best);
+                }
+                writer.put(word, best * group);
+            }
+        }
+        // Whether each quotient is nonzero, then the nonzero ones less one in
+        // unary.
+        uint32_t nonzero = 0;
+#ifdef __SSE2__
+        if (count == blockValues) {
+            const __m128i zero = _mm_setzero_si128();
+            auto high = _mm_set1_epi8((char)(0xFF << best));
+            auto first = _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i *)values), high), zero);
+            auto second = _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i *)(values + 16)), high), zero);
+            nonzero = ~(uint32_t)(_mm_movemask_epi8(first) | _mm_movemask_epi8(second) << 16);
+        } else
+#endif
+        for (size_t i = 0; i < count; i += 1) {
+            nonzero |= (uint32_t)(values[i] >> best != 0) << i;
+        }
+        writer.put(nonzero, count);
+
+        uint64_t word = 0;
+        int length = 0;
+#ifdef __SSE2__
+        if (unaryBits <= 56 && count == blockValues) {
+            // Same as below, but the running length is a prefix sum over the
+            // quotients, 16 at a time, and each end is set by lookup. A zero
+            // quotient lands on the end before it, or on bit 0, so it needs
+            // no test.
+            const __m128i low = _mm_set1_epi8((char)(0xFF >> best));
+            auto shift = _mm_cvtsi32_si128(best);
+            auto ends = [&](const uint8_t *block) {
+                auto sum = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128((const __m128i *)block), shift), low);
+                sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 1));
+                sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 2));
+                sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 4));
+                return _mm_add_epi8(sum, _mm_slli_si128(sum, 8));
+            };
+            alignas(16) uint8_t positions[blockValues];
+            auto first = ends(values);
+            auto high = _mm_unpackhi_epi8(first, first);
+            auto carry = _mm_shuffle_epi32(_mm_unpackhi_epi16(high, high), 0xFF);
+            _mm_store_si128((__m128i *)positions, first);
+            _mm_store_si128((__m128i *)(positions + 16), _mm_add_epi8(ends(values + 16), carry));
+            // Four chains, so the ORs don't wait on each other.
+            uint64_t words[4] = {0, 0, 0, 0};
+            for (size_t i = 0; i < blockValues; i += 4) {
+                words[0] |= powers.bit[positions[i]];
+                words[1] |= powers.bit[positions[i + 1]];
+                words[2] |= powers.bit[positions[i + 2]];
+                words[3] |= powers.bit[positions[i + 3]];
+            }
+            word = words[0] | words[1] | words[2] | words[3];
+            writer.put(word >> 1, unaryBits);
+            return;
+        }
+#endif
+        if (unaryBits <= 56) {
+            // A nonzero quotient q takes q bits from here on and a zero one
+            // none, so all of them can go in one word without branching.
+            for (size_t i = 0; i < count; i += 1) {
+                uint32_t quotient = values[i] >> best;
+                word |= (uint64_t)(quotient != 0) << (length + quotient);
+                length += quotient;
+            }
+            writer.put(word >> 1, length);
+            return;
+        }
+        for (auto pending = nonzero; pending; pending &= pending - 1) {
+            uint32_t zeroes = (values[__builtin_ctz(pending)] >> best) - 1;
+            if (length + zeroes >= 56) {
+                writer.put(word, length);
+                word = 0;
+                length = 0;
+                if (zeroes >= 56) {
+                    writer.unary(zeroes);
+                    continue;
+                }
+            }
+            word |= 1ull << (length + zeroes);
+            length += zeroes + 1;
+        }
+        writer.put(word, length);
+    }
+
+    /// Reverses encodeBlock() into `count` bytes. False on an invalid code
+    /// or a block that runs past the end.
+    inline bool decodeBlock(BitReader &reader, uint8_t *values, size_t count) {
+        auto code = reader.peek() & 15;
+        reader.position += 4;
+        if (code == Zero) {
+            memset(values, 0, count);
+            return true;
+        }
+        if (code == Raw) {
+            for (size_t i = 0; i < count; i += 7) {
+                auto word = reader.peek();
+                auto group = std::min<size_t>(7, count - i);
+                for (size_t j = 0; j < group; j += 1) {
+                    values[i + j] = (uint8_t)(word >> (8 * j));
+                }
+                reader.position += 8 * group;
+            }
+            return !reader.overrun();
+        }
+        if (code > 8) {
+            return false;
+        }
+
+        int k = code - 1;
+        if (k == 0) {
+            memset(values, 0, count);
+        }
+#ifdef __SSE2__
+        else if (count == blockValues) {
+            uint64_t mask = (1ull << (8 * k)) - 1;
+            for (size_t i = 0; i < count; i += 16) {
+                auto first = reader.peek() & mask;
+                reader.position += 8 * k;
+                auto second = reader.peek() & mask;
+                reader.position += 8 * k;
+                auto packed = _mm_set_epi64x((long long)second, (long long)first);
+                _mm_storeu_si128((__m128i *)(values + i), unpackBits(packed, k));
+            }
+        }
+#endif
+        else {
+            // Eight remainders of at most 7 bits fit in one 56 bit read.
+            uint32_t mask = (1u << k) - 1;
+            for (size_t i = 0; i < count; i += 8) {
+                auto word = reader.peek();
+                auto group = std::min<size_t>(8, count - i);
+                for (size_t j = 0; j < group; j += 1) {
+                    values[i + j] = (uint8_t)((word >> (j * k)) & mask);
+                }
+                reader.position += k * group;
+            }
+        }
+
+        auto nonzero = (uint32_t)reader.peek() & (uint32_t)((1ull << count) - 1);
+        reader.position += count;
+#ifdef __SSE2__
+        if (count == blockValues) {
+            // Spread the bits to bytes: each byte of the pair of words holds
+            // eight of them, and each lane picks out its own.
+            const __m128i select = _mm_set1_epi64x(0x8040201008040201ll);
+            const __m128i one = _mm_set1_epi8((char)(1 << k));
+            for (size_t i = 0; i < count; i += 16) {
+                auto bits = nonzero >> i;
+                auto spread = _mm_set_epi64x((long long)(((bits >> 8) & 0xFF) * 0x0101010101010101ull),
+                                             (long long)((bits & 0xFF) * 0x0101010101010101ull));
+                auto set = _mm_cmpeq_epi8(_mm_and_si128(spread, select), select);
+                auto target = (__m128i *)(values + i);
+                _mm_storeu_si128(target, _mm_add_epi8(_mm_loadu_si128(target), _mm_and_si128(set, one)));
+            }
+        } else
+#endif
+        for (size_t i = 0; i < count; i += 1) {
+            values[i] += (uint8_t)(((nonzero >> i) & 1) << k);
+        }
+
+        // Each one bit ends a quotient; the zeroes before it are what's left.
+        uint32_t zeroes = 0;
+        auto pending = nonzero;
+        while (pending) {
+            auto word = reader.peek();
+            int consumed = 0;
+            while (word && pending) {
+                int bit = __builtin_ctzll(word);
+                values[__builtin_ctz(pending)] += (uint8_t)((zeroes + bit - consumed) << k);
+                zeroes = 0;
+                consumed = bit + 1;
+                word &= word - 1;
+                pending &= pending - 1;
+            }
+            if (pending) {
+                zeroes += 56 - consumed;
+                reader.position += 56;
+                if (reader.overrun() || zeroes > 255) {
+                    return false;
+                }
+            } else {
+                reader.position += consumed;
+            }
+        }
+        return !reader.overrun();
+    }
+
+    /// Turns a row of decoded zigzagged residuals back into pixels.
+    inline void reconstruct(Predictor predictor, uint8_t *row, const uint8_t *up, size_t rowBytes) {
+        size_t i = 0;
+        if (predictor == Up) {
+#ifdef __SSE2__
+            const __m128i one = _mm_set1_epi8(1);
+            const __m128i low = _mm_set1_epi8(0x7F);
+            for (; i + 16 <= rowBytes; i += 16) {
+                auto value = _mm_loadu_si128((const __m128i *)(row + i));
+                auto residual = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(value, 1), low), _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(value, one)));
+                _mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(residual, _mm_loadu_si128((const __m128i *)(up + i))));
+            }
+#endif
+            for (; i < rowBytes; i += 1) {
+                row[i] = unzigzag(row[i]) + up[i];
+            }
+            return;
+        }
+
+        // Left and gradient are a running sum per component along the row:
+        // of the pixels for left, of the differences to the row above for
+        // gradient.
+#ifdef __SSE2__
+        const __m128i one = _mm_set1_epi8(1);
+        const __m128i low = _mm_set1_epi8(0x7F);
+        const __m128i even = _mm_set1_epi16(0x00FF);
+        const __m128i firstByte = _mm_set1_epi32(0xFF);
+        __m128i carry = _mm_setzero_si128();
+        for (; i + 16 <= rowBytes; i += 16) {
+            auto value = _mm_loadu_si128((const __m128i *)(row + i));
+            auto sum = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(value, 1), low), _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(value, one)));
+            // Y runs every 2 bytes, U and V every 4: a prefix sum in three
+            // steps, the first only for Y.
+            sum = _mm_add_epi8(sum, _mm_and_si128(_mm_slli_si128(sum, 2), even));
+            sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 4));
+            sum = _mm_add_epi8(sum, _mm_slli_si128(sum, 8));
+            sum = _mm_add_epi8(sum, carry);
+            // The last Y, U and V carry over to the next 16: bytes 12 to 15
+            // are Y U Y V, and the second Y is the later one.
+            auto last = _mm_shuffle_epi32(sum, 0xFF);
+            carry = _mm_or_si128(_mm_andnot_si128(firstByte, last), _mm_and_si128(_mm_srli_epi32(last, 16), firstByte));
+            _mm_storeu_si128((__m128i *)(row + i), sum);
+        }
+        if (predictor == Gradient) {
+            size_t j = 0;
+            for (; j + 16 <= i; j += 16) {
+                auto sum = _mm_loadu_si128((const __m128i *)(row + j));
+                _mm_storeu_si128((__m128i *)(row + j), _mm_add_epi8(sum, _mm_loadu_si128((const __m128i *)(up + j))));
+            }
+        }
+#endif
+        size_t vectorized = i;
+        for (; i < rowBytes; i += 1) {
+            auto offset = leftOffset(i);
+            uint8_t previous = 0;
+            if (i >= offset) {
+                // Vectorized bytes already had `up` added back.
+                previous = row[i - offset] - (predictor == Gradient && i - offset < vectorized ? up[i - offset] : 0);
+            }
+            row[i] = unzigzag(row[i]) + previous;
+        }
+        if (predictor == Gradient) {
+            for (i = vectorized; i < rowBytes; i += 1) {
+                row[i] += up[i];
+            }
+        }
+    }
+
+    /// Compresses `rows` rows of `rowBytes` YUYV bytes, `step` apart, into
+    /// `out`, which must hold bound(rowBytes, rows). Returns the bytes used.
+    inline size_t compress(const uint8_t *data, size_t step, size_t rowBytes, int rows, uint8_t *out) {
+        auto start = out;
+        uint8_t values[blockValues];
+        for (int y = 0; y < rows; y += 1) {
+            auto row = data + y * step;
+            auto up = y ? row - step : NULL;
+
+            auto predictor = up ? choose(row, up, rowBytes) : Left;
+            *out++ = predictor;
+
+            BitWriter writer(out);
+            for (size_t x = 0; x < rowBytes; x += blockValues) {
+                auto count = std::min(blockValues, rowBytes - x);
+                residuals(predictor, row, up, x, std::min<size_t>(16, count), values);
+                if (count > 16) {
+                    residuals(predictor, row, up, x + 16, count - 16, values + 16);
+                }
+                encodeBlock(values, count, writer);
+            }
+            out = writer.finish();
+        }
+        return out - start;
+    }
+
+    /// Reverses compress() into `rows` rows of `rowBytes`, `step` apart.
+    /// Returns false if the input is truncated or corrupt.
+    inline bool decompress(const uint8_t *in, size_t bytes, uint8_t *data, size_t step, size_t rowBytes, int rows) {
+        BitReader reader(in, bytes);
+        for (int y = 0; y < rows; y += 1) {
+            auto row = data + y * step;
+            auto up = y ? row - step : NULL;
+            if ((reader.position >> 3) >= bytes) {
+                return false;
+            }
+            auto predictor = (Predictor)in[reader.position >> 3];
+            reader.position += 8;
+            if (predictor > Gradient || (!up && predictor != Left)) {
+                return false;
+            }
+            for (size_t x = 0; x < rowBytes; x += blockValues) {
+                if (!decodeBlock(reader, row + x, std::min(blockValues, rowBytes - x))) {
+                    return false;
+                }
+            }
+            reader.align();
+            reconstruct(predictor, row, up, rowBytes);
+        }
+        return reader.position == bytes * 8;
+    }
+}
+
+#endif // _codec_hpp
@@ -0,0 +1,190 @@
+#ifndef _control_hpp
+#define _control_hpp
+
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <cstring> // strncpy
+#include <thread>
+#include <optional>
+#include <stdexcept>
+#include <condition_variable>
+
+namespace Control {
+    /// A line of text asking the main thread to do something, and where the
+    /// answer goes (nowhere, for keypresses).
+    struct Command {
+        std::string line;
+        std::shared_ptr<std::promise<std::string>> reply;
+
+        void respond(std::string answer) {
+            if (reply) {
+                reply->set_value(answer);
+            }
+        }
+    };
+
+    /// Queue of commands for the main thread.
+    ///
+    /// Things like restarting the UVC stream can't happen on the libuvc
+    /// callback thread (stopping the stream joins it), so keypresses and
+    /// socket clients post here and the main thread executes.
+    struct Channel {
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<Command> queue;
+
+        void post(std::string line, std::shared_ptr<std::promise<std::string>> reply = nullptr) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back({line, reply});
+            }
+            condition.notify_one();
+        }
+
+        /// Waits up to `timeout` for a command.
+        template <typename Duration>
+        std::optional<Command> next(Duration timeout) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!condition.wait_for(lock, timeout, [this](){ return !queue.empty(); })) {
+                return std::nullopt;
+            }
+            auto command = queue.front();
+            queue.pop_front();
+            return command;
+        }
+    };
+
+    /// Listens on a Unix domain socket and forwards each line a client sends
+    /// to a Channel, writing the answer back followed by a newline. One
+    /// client at a time, e.g. `echo "mode 1920 1080 30" | nc -U path`.
+    /// Clients that hang up early are simply dropped, as are ones that send
+    /// a line longer than `maxLine`.
+    struct SocketServer {
+        static const size_t maxLine = 4096;
+
+        Channel &channel;
+        std::string path;
+        int listener = -1;
+        std::atomic<int> client{-1};
+        std::atomic<bool> stopping{false};
+        std::thread thread;
+
+        SocketServer(Channel &channel, std::string path): channel(channel), path(path) {
+            sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof address.sun_path) {
+                throw std::runtime_error("Control socket path is too long.");
+            }
+            strncpy(address.sun_path, path.c_str(), sizeof address.sun_path - 1);
+
+            listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listener < 0) {
+                throw std::runtime_error("Failed to create control socket.");
+            }
+            unlink(path.c_str());
+            if (bind(listener, (sockaddr*)&address, sizeof address) < 0 || listen(listener, 4) < 0) {
+                close(listener);
+                throw std::runtime_error("Failed to listen on control socket " + path + ".");
+            }
+
+            thread = std::thread([this](){ run(); });
+        }
+
+        ~SocketServer() {
+            stopping = true;
+            shutdown(listener, SHUT_RDWR);
+            auto connected = client.load();
+            if (connected >= 0) {
+                shutdown(connected, SHUT_RDWR);
+            }
+            thread.join();
+            close(listener);
+            unlink(path.c_str());
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        SocketServer(SocketServer const&) = delete;
+        SocketServer& operator=(SocketServer const&) = delete;
+
+    private:
+        void run() {
+            while (!stopping) {
+                int connection = accept(listener, NULL, NULL);
+                if (connection < 0) {
+                    if (stopping) {
+                        return;
+                    }
+                    continue;
+                }
+                client = connection;
+                serve(connection);
+                client = -1;
+                close(connection);
+            }
+        }
+
+        void serve(int connection) {
+            std::string line;
+            char buffer[256];
+            ssize_t received;
+            while (!stopping && (received = read(connection, buffer, sizeof buffer)) > 0) {
+                for (ssize_t i = 0; i < received; i += 1) {
+                    if (buffer[i] != '\n') {
+                        line += buffer[i];
+                        if (line.size() > maxLine) {
+                            reply(connection, "error: line too long\n");
+                            return;
+                        }
+                        continue;
+                    }
+                    if (!line.empty() && line.back() == '\r') {
+                        line.pop_back();
+                    }
+                    auto promise = std::make_shared<std::promise<std::string>>();
+                    auto answer = promise->get_future();
+                    channel.post(line, promise);
+                    line.clear();
+
+                    while (answer.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+                        if (stopping) {
+                            return;
+                        }
+                    }
+                    std::string text;
+                    try {
+                        text = answer.get() + "\n";
+                    } catch (std::future_error &) {
+                        text = "error: command dropped\n";
+                    }
+                    if (!reply(connection, text)) {
+                        return;
+                    }
+                }
+            }
+        }
+
+        /// False if the client has gone. MSG_NOSIGNAL, or a client hanging up
+        /// first would take the whole process down with SIGPIPE.
+        static bool reply(int connection, const std::string &text) {
+            for (size_t sent = 0; sent < text.size();) {
+                auto count = send(connection, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                if (count < 0) {
+                    return false;
+                }
+                sent += count;
+            }
+            return true;
+        }
+    };
+}
+
+#endif // _control_hpp
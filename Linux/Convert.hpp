@@ -0,0 +1,41 @@
+#ifndef _convert_hpp
+#define _convert_hpp
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Convert {
+    inline uint8_t clamp8(int value) {
+        return value < 0 ? 0 : (value > 255 ? 255 : value);
+    }
+
+    /// Packed YUYV to packed BGR for the rectangle [x0, x1) x [y0, y1).
+    ///
+    /// Full-range BT.601 (JFIF), with the same 14-bit fixed-point constants as
+    /// the IYUYV2BGR macros behind libuvc's uvc_yuyv2bgr, so the output matches
+    /// it exactly: each term is shifted right (rounding down) and then added to
+    /// Y and clamped. Working on rectangles lets callers only redo the regions
+    /// of a frame that actually changed. x0 and x1 must be even.
+    inline void yuyvToBgr(const uint8_t *src, size_t srcStep, uint8_t *dst, size_t dstStep, int x0, int x1, int y0, int y1) {
+        for (int y = y0; y < y1; y += 1) {
+            auto in = src + y * srcStep + x0 * 2;
+            auto out = dst + y * dstStep + x0 * 3;
+            for (int x = x0; x < x1; x += 2) {
+                int ya = in[0], u = in[1] - 128, yb = in[2], v = in[3] - 128;
+                int r = (22987 * v) >> 14;
+                int g = (-5636 * u - 11698 * v) >> 14;
+                int b = (29049 * u) >> 14;
+                out[0] = clamp8(ya + b);
+                out[1] = clamp8(ya + g);
+                out[2] = clamp8(ya + r);
+                out[3] = clamp8(yb + b);
+                out[4] = clamp8(yb + g);
+                out[5] = clamp8(yb + r);
+                in += 4;
+                out += 6;
+            }
+        }
+    }
+}
+
+#endif // _convert_hpp
@@ -0,0 +1,275 @@
+#ifndef _deinterlace_hpp
+#define _deinterlace_hpp
+
+#include <libuvc/libuvc.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring> // memcpy
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "Async.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+namespace Video {
+    enum class Deinterlace {
+        Off = 0,
+        Bob = 1,
+        Blend = 2,
+        Adaptive = 3,
+    };
+
+    inline const char* deinterlaceName(Deinterlace mode) {
+        switch (mode) {
+        case Deinterlace::Bob: return "bob";
+        case Deinterlace::Blend: return "blend";
+        case Deinterlace::Adaptive: return "adaptive";
+        default: return "off";
+        }
+    }
+
+    inline bool deinterlaceByName(std::string name, Deinterlace &mode) {
+        for (auto candidate: {Deinterlace::Off, Deinterlace::Bob, Deinterlace::Blend, Deinterlace::Adaptive}) {
+            if (name == deinterlaceName(candidate)) {
+                mode = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Line kernels on packed YUYV. Every byte only ever mixes with the
+    /// bytes directly above and below it, which are the same component, so
+    /// Y and chroma need no special casing. The SSE2 and scalar paths give
+    /// identical output: averages round up like _mm_avg_epu8.
+    namespace Lines {
+        inline uint8_t average(uint8_t a, uint8_t b) {
+            return (a + b + 1) >> 1;
+        }
+
+        /// The missing line as the average of its neighbours.
+        inline void interpolate(const uint8_t *above, const uint8_t *below, uint8_t *out, size_t bytes) {
+            size_t i = 0;
+#ifdef __SSE2__
+            for (; i + 16 <= bytes; i += 16) {
+                auto a = _mm_loadu_si128((const __m128i *)(above + i));
+                auto b = _mm_loadu_si128((const __m128i *)(below + i));
+                _mm_storeu_si128((__m128i *)(out + i), _mm_avg_epu8(a, b));
+            }
+#endif
+            for (; i < bytes; i += 1) {
+                out[i] = average(above[i], below[i]);
+            }
+        }
+
+        /// A 1-2-1 vertical filter, which folds both fields into every line.
+        inline void blend(const uint8_t *above, const uint8_t *line, const uint8_t *below, uint8_t *out, size_t bytes) {
+            size_t i = 0;
+#ifdef __SSE2__
+            for (; i + 16 <= bytes; i += 16) {
+                auto a = _mm_loadu_si128((const __m128i *)(above + i));
+                auto l = _mm_loadu_si128((const __m128i *)(line + i));
+                auto b = _mm_loadu_si128((const __m128i *)(below + i));
+                _mm_storeu_si128((__m128i *)(out + i), _mm_avg_epu8(_mm_avg_epu8(a, b), l));
+            }
+#endif
+            for (; i < bytes; i += 1) {
+                out[i] = average(average(above[i], below[i]), line[i]);
+            }
+        }
+
+        /// Keeps the other field's line where nothing moved since the last
+        /// frame (full vertical resolution on static content) and falls back
+        /// to interpolating where something did (no combing on motion).
+        /// Motion is any of the line or its neighbours changing by more than
+        /// `threshold` against the previous frame.
+        inline void adaptive(const uint8_t *above, const uint8_t *line, const uint8_t *below,
+                             const uint8_t *lastAbove, const uint8_t *lastLine, const uint8_t *lastBelow,
+                             uint8_t threshold, uint8_t *out, size_t bytes) {
+            size_t i = 0;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i limit = _mm_set1_epi8((char)threshold);
+            auto distance = [](__m128i x, __m128i y) {
+                return _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+            };
+            for (; i + 16 <= bytes; i += 16) {
+                auto a = _mm_loadu_si128((const __m128i *)(above + i));
+                auto l = _mm_loadu_si128((const __m128i *)(line + i));
+                auto b = _mm_loadu_si128((const __m128i *)(below + i));
+                auto change = _mm_max_epu8(distance(l, _mm_loadu_si128((const __m128i *)(lastLine + i))),
+                              _mm_max_epu8(distance(a, _mm_loadu_si128((const __m128i *)(lastAbove + i))),
+                                           distance(b, _mm_loadu_si128((const __m128i *)(lastBelow + i)))));
+                // Still wherever change <= threshold.
+                auto still = _mm_cmpeq_epi8(_mm_subs_epu8(change, limit), zero);
+                auto interpolated = _mm_avg_epu8(a, b);
+                _mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(_mm_and_si128(still, l), _mm_andnot_si128(still, interpolated)));
+            }
+#endif
+            for (; i < bytes; i += 1) {
+                int change = std::max({std::abs(line[i] - lastLine[i]), std::abs(above[i] - lastAbove[i]), std::abs(below[i] - lastBelow[i])});
+                out[i] = change <= threshold ? line[i] : average(above[i], below[i]);
+            }
+        }
+    }
+
+    /// Turns interlaced YUYV frames into progressive ones ahead of the
+    /// preview.
+    ///
+    /// Bob and adaptive can emit one frame per field (`doubleRate`), the
+    /// first field's frame then the second's, which turns 1080i30 frames back
+    /// into 60 progressive frames a second. Blend mixes both fields into one
+    /// frame so it never doubles. Work is split into horizontal stripes over
+    /// `threads` threads, the calling thread included.
+    struct Deinterlacer {
+        std::atomic<Deinterlace> mode;
+        std::atomic<bool> doubleRate;
+        bool topFieldFirst;
+        uint8_t threshold = 12;
+        size_t threads;
+
+        std::vector<uint8_t> outputs[2];
+        std::vector<uint8_t> last;
+        std::vector<uint8_t> next;
+        bool haveLast = false;
+        int width = 0;
+        int height = 0;
+        Metrics::Clock::time_point lastFrame;
+        Metrics::Clock::duration interval = std::chrono::milliseconds(33);
+
+        Metrics::Timer time{"deinterlace.time"};
+        Metrics::Counter fields{"deinterlace.frames_out"};
+        std::unique_ptr<Async::Pool> stripes;
+
+        Deinterlacer(Deinterlace mode, bool doubleRate, bool topFieldFirst = true, size_t threads = 1):
+            mode(mode),
+            doubleRate(doubleRate),
+            topFieldFirst(topFieldFirst),
+            threads(std::max<size_t>(threads, 1)),
+            stripes(threads > 1 ? new Async::Pool(threads - 1) : NULL) {}
+
+        ///This is a managed RAII resource. this object is not copyable
+        Deinterlacer(Deinterlacer const&) = delete;
+        Deinterlacer& operator=(Deinterlacer const&) = delete;
+
+        /// Deinterlaces `frame` into `out`. Returns how many frames were
+        /// produced: 0 if it's off or the frame isn't YUYV (use `frame` as
+        /// is), otherwise 1, or 2 when doubling. The output stays valid until
+        /// the next call. Call from one thread only.
+        int process(uvc_frame_t *frame, uvc_frame_t out[2]) {
+            auto current = mode.load();
+            if (current == Deinterlace::Off || frame->frame_format != UVC_FRAME_FORMAT_YUYV || frame->height < 2) {
+                haveLast = false;
+                return 0;
+            }
+
+            Trace::Span span("deinterlace", (int)current);
+            Metrics::Scope scope(time);
+            auto now = Metrics::Clock::now();
+            interval = now - lastFrame < std::chrono::milliseconds(200) ? now - lastFrame : interval;
+            lastFrame = now;
+
+            resize(frame->width, frame->height);
+            size_t rowBytes = width * 2;
+            size_t step = frame->step ? frame->step : rowBytes;
+            auto data = (const uint8_t *)frame->data;
+
+            int count = (current == Deinterlace::Blend || !doubleRate) ? 1 : 2;
+            if (current == Deinterlace::Adaptive && !haveLast) {
+                // Nothing to compare against yet; everything counts as moving.
+                current = Deinterlace::Bob;
+            }
+
+            size_t parts = std::min<size_t>(threads, std::max(1, height / 16));
+            auto work = [&](size_t part) {
+                int y0 = height * part / parts, y1 = height * (part + 1) / parts;
+                for (int field = 0; field < count; field += 1) {
+                    // Lines of this parity come straight from the input.
+                    int parity = topFieldFirst == (field == 0) ? 0 : 1;
+                    for (int y = y0; y < y1; y += 1) {
+                        line(current, parity, data, step, y, outputs[field].data() + y * rowBytes);
+                    }
+                }
+                // Kept for the next frame's motion check. Other stripes still
+                // read `last` around the edges, hence the second buffer.
+                for (int y = y0; y < y1; y += 1) {
+                    memcpy(next.data() + y * rowBytes, data + y * step, rowBytes);
+                }
+            };
+            if (stripes && parts > 1) {
+                stripes->parallel(parts, work);
+            } else {
+                work(0);
+            }
+
+            last.swap(next);
+            haveLast = true;
+
+            for (int field = 0; field < count; field += 1) {
+                out[field] = *frame;
+                out[field].data = outputs[field].data();
+                out[field].data_bytes = rowBytes * height;
+                out[field].step = rowBytes;
+                out[field].library_owns_data = 1;
+            }
+            fields.add(count);
+            return count;
+        }
+
+        /// When the second of a pair of doubled frames should be shown: half
+        /// a frame interval after the first.
+        Metrics::Clock::time_point secondFieldDue() {
+            return lastFrame + interval / 2;
+        }
+
+    private:
+        void resize(int frameWidth, int frameHeight) {
+            if (frameWidth == width && frameHeight == height) {
+                return;
+            }
+            width = frameWidth;
+            height = frameHeight;
+            for (auto &output: outputs) {
+                output.assign(width * 2 * height, 0);
+            }
+            last.assign(width * 2 * height, 0);
+            next.assign(width * 2 * height, 0);
+            haveLast = false;
+        }
+
+        void line(Deinterlace current, int parity, const uint8_t *data, size_t step, int y, uint8_t *out) {
+            size_t rowBytes = width * 2;
+            auto row = [&](int index) { return data + std::min(std::max(index, 0), height - 1) * step; };
+            auto lastRow = [&](int index) { return last.data() + std::min(std::max(index, 0), height - 1) * rowBytes; };
+
+            if (current == Deinterlace::Blend) {
+                Lines::blend(row(y - 1), row(y), row(y + 1), out, rowBytes);
+                return;
+            }
+            if ((y & 1) == parity) {
+                memcpy(out, row(y), rowBytes);
+                return;
+            }
+            // Past the edges the kept field's nearest line stands in.
+            int above = y - 1 >= 0 ? y - 1 : y + 1;
+            int below = y + 1 < height ? y + 1 : y - 1;
+            if (current == Deinterlace::Bob) {
+                Lines::interpolate(row(above), row(below), out, rowBytes);
+            } else {
+                Lines::adaptive(row(above), row(y), row(below), lastRow(above), lastRow(y), lastRow(below), threshold, out, rowBytes);
+            }
+        }
+    };
+}
+
+#endif // _deinterlace_hpp
@@ -0,0 +1,62 @@
+#ifndef _demand_hpp
+#define _demand_hpp
+
+#include <atomic>
+
+namespace Video {
+    /// Pipeline stages a consumer can ask for. Raw is the YUYV frame as
+    /// libuvc delivers it; Converted is the BGR preview image.
+    enum class Stage {
+        Raw = 0,
+        Converted = 1,
+    };
+
+    /// Counts who currently wants the output of each stage, so the capture
+    /// callback can skip stages nobody is looking at.
+    struct Demand {
+        std::atomic<int> consumers[2];
+
+        Demand() {
+            consumers[0] = 0;
+            consumers[1] = 0;
+        }
+
+        bool wants(Stage stage) {
+            return consumers[(int)stage].load(std::memory_order_relaxed) > 0;
+        }
+
+        bool any() {
+            return wants(Stage::Raw) || wants(Stage::Converted);
+        }
+
+        /// One consumer's registration. Toggle it as the consumer comes and
+        /// goes; it unregisters itself when destroyed.
+        struct Consumer {
+            Demand &demand;
+            Stage stage;
+            bool active = false;
+
+            Consumer(Demand &demand, Stage stage, bool active = false): demand(demand), stage(stage) {
+                set(active);
+            }
+
+            ~Consumer() {
+                set(false);
+            }
+
+            ///This is a managed RAII resource. this object is not copyable
+            Consumer(Consumer const&) = delete;
+            Consumer& operator=(Consumer const&) = delete;
+
+            void set(bool wanted) {
+                if (wanted == active) {
+                    return;
+                }
+                active = wanted;
+                demand.consumers[(int)stage].fetch_add(wanted ? 1 : -1, std::memory_order_relaxed);
+            }
+        };
+    };
+}
+
+#endif // _demand_hpp
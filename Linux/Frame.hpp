@@ -0,0 +1,121 @@
+#ifndef _frame_hpp
+#define _frame_hpp
+
+#include <libuvc/libuvc.h>
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstring> // memcpy
+
+namespace Video {
+    /// An owned copy of a libuvc frame. libuvc only lends us frame->data for
+    /// the duration of the callback, so anything that outlives the callback
+    /// (encoders, workers) has to go through one of these.
+    struct Frame {
+        std::vector<uint8_t> data;
+        size_t bytes = 0;
+        int width = 0;
+        int height = 0;
+        size_t step = 0;
+        uvc_frame_format format = UVC_FRAME_FORMAT_UNKNOWN;
+        uint32_t sequence = 0;
+        struct timeval captureTime = {0, 0};
+
+        Frame(size_t capacity): data(capacity) {}
+
+        ///Pooled frames are never copied, only referenced.
+        Frame(Frame const&) = delete;
+        Frame& operator=(Frame const&) = delete;
+
+        bool copyFrom(uvc_frame_t *source) {
+            if (source->data_bytes > data.size()) {
+                return false;
+            }
+            memcpy(data.data(), source->data, source->data_bytes);
+            bytes = source->data_bytes;
+            width = source->width;
+            height = source->height;
+            step = source->step ? source->step : source->data_bytes / source->height;
+            format = source->frame_format;
+            sequence = source->sequence;
+            captureTime = source->capture_time;
+            return true;
+        }
+    };
+
+    typedef std::shared_ptr<Frame> FrameRef;
+
+    /// A fixed set of preallocated frames handed out as shared references.
+    ///
+    /// Dropping the last reference returns the frame to the pool, so the
+    /// capture thread never allocates. If every frame is in flight,
+    /// acquire() returns an empty reference and the caller drops the frame.
+    struct FramePool {
+        struct Storage {
+            std::mutex mutex;
+            std::vector<Frame*> free;
+            std::vector<std::unique_ptr<Frame>> frames;
+            size_t frameCapacity = 0;
+        };
+
+        std::shared_ptr<Storage> storage;
+
+        FramePool(size_t count, size_t frameCapacity): storage(std::make_shared<Storage>()) {
+            storage->frameCapacity = frameCapacity;
+            for (size_t i = 0; i < count; i += 1) {
+                storage->frames.emplace_back(new Frame(frameCapacity));
+                storage->free.push_back(storage->frames.back().get());
+            }
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        FramePool(FramePool const&) = delete;
+        FramePool& operator=(FramePool const&) = delete;
+
+        FrameRef acquire() {
+            Frame *frame = NULL;
+            {
+                std::lock_guard<std::mutex> lock(storage->mutex);
+                if (storage->free.empty()) {
+                    return FrameRef();
+                }
+                frame = storage->free.back();
+                storage->free.pop_back();
+            }
+            // The deleter keeps the storage alive, so outstanding references
+            // stay valid even if the pool itself is gone.
+            auto keepAlive = storage;
+            return FrameRef(frame, [keepAlive](Frame *returned) {
+                std::lock_guard<std::mutex> lock(keepAlive->mutex);
+                if (returned->data.size() < keepAlive->frameCapacity) {
+                    returned->data.resize(keepAlive->frameCapacity);
+                }
+                keepAlive->free.push_back(returned);
+            });
+        }
+
+        /// Grows every frame to hold at least `frameCapacity` bytes, e.g.
+        /// after switching to a higher resolution. Free frames grow now,
+        /// frames in flight when they come back, so the capture thread never
+        /// allocates. Never shrinks.
+        void reserve(size_t frameCapacity) {
+            std::lock_guard<std::mutex> lock(storage->mutex);
+            if (frameCapacity <= storage->frameCapacity) {
+                return;
+            }
+            storage->frameCapacity = frameCapacity;
+            for (auto frame: storage->free) {
+                frame->data.resize(frameCapacity);
+            }
+        }
+
+        size_t available() {
+            std::lock_guard<std::mutex> lock(storage->mutex);
+            return storage->free.size();
+        }
+    };
+}
+
+#endif // _frame_hpp
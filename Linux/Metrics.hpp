@@ -0,0 +1,128 @@
+#ifndef _metrics_hpp
+#define _metrics_hpp
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+namespace Metrics {
+    typedef std::chrono::steady_clock Clock;
+
+    inline uint64_t nanosecondsSince(Clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    struct Metric {
+        std::string name;
+
+        Metric(std::string name);
+        virtual ~Metric();
+
+        virtual void print(FILE *stream) = 0;
+    };
+
+    /// Every metric registers itself here on construction (and removes itself
+    /// on destruction) so they can all be dumped together.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<Metric*> metrics;
+
+        static Registry& shared() {
+            static Registry registry;
+            return registry;
+        }
+
+        void add(Metric *metric) {
+            std::lock_guard<std::mutex> lock(mutex);
+            metrics.push_back(metric);
+        }
+
+        void remove(Metric *metric) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = metrics.begin(); it != metrics.end(); ++it) {
+                if (*it == metric) {
+                    metrics.erase(it);
+                    break;
+                }
+            }
+        }
+
+        void print(FILE *stream) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto metric: metrics) {
+                metric->print(stream);
+            }
+            fflush(stream);
+        }
+    };
+
+    inline Metric::Metric(std::string name): name(name) {
+        Registry::shared().add(this);
+    }
+
+    inline Metric::~Metric() {
+        Registry::shared().remove(this);
+    }
+
+    struct Counter: Metric {
+        std::atomic<uint64_t> value{0};
+
+        Counter(std::string name): Metric(name) {}
+
+        void add(uint64_t amount = 1) {
+            value.fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        void print(FILE *stream) override {
+            fprintf(stream, "%-28s %llu\n", name.c_str(), (unsigned long long)value.load(std::memory_order_relaxed));
+        }
+    };
+
+    /// Accumulates durations. Safe to record() from any thread.
+    struct Timer: Metric {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> totalNs{0};
+        std::atomic<uint64_t> maxNs{0};
+
+        Timer(std::string name): Metric(name) {}
+
+        void record(uint64_t ns) {
+            count.fetch_add(1, std::memory_order_relaxed);
+            totalNs.fetch_add(ns, std::memory_order_relaxed);
+            auto previous = maxNs.load(std::memory_order_relaxed);
+            while (ns > previous && !maxNs.compare_exchange_weak(previous, ns, std::memory_order_relaxed)) {}
+        }
+
+        double averageMs() {
+            auto n = count.load(std::memory_order_relaxed);
+            return n ? totalNs.load(std::memory_order_relaxed) / 1e6 / n : 0.0;
+        }
+
+        void print(FILE *stream) override {
+            fprintf(stream, "%-28s n=%llu avg=%.3fms max=%.3fms\n",
+                name.c_str(),
+                (unsigned long long)count.load(std::memory_order_relaxed),
+                averageMs(),
+                maxNs.load(std::memory_order_relaxed) / 1e6
+            );
+        }
+    };
+
+    /// Records the lifetime of the scope into a Timer.
+    struct Scope {
+        Timer &timer;
+        Clock::time_point start;
+
+        Scope(Timer &timer): timer(timer), start(Clock::now()) {}
+
+        ~Scope() {
+            timer.record(nanosecondsSince(start));
+        }
+    };
+}
+
+#endif // _metrics_hpp
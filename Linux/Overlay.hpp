@@ -0,0 +1,33 @@
+#ifndef _overlay_hpp
+#define _overlay_hpp
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Video {
+    /// Something drawn on top of the preview, like the scopes.
+    ///
+    /// The preview keeps its converted image pristine: it saves the pixels
+    /// under rect(), lets the overlay draw, shows the result and restores
+    /// them, so overlays never bleed into tiles that static detection skips.
+    struct Overlay {
+        struct Rect {
+            int x, y, width, height;
+        };
+
+        virtual ~Overlay() {}
+
+        /// Whether there is anything to draw at all.
+        virtual bool visible() = 0;
+
+        /// Whether the overlay changed since it was last drawn, which forces
+        /// a redraw even if the frame underneath didn't change.
+        virtual bool changed() = 0;
+
+        virtual Rect rect(int width, int height) = 0;
+
+        virtual void draw(uint8_t *bgr, size_t step, Rect rect) = 0;
+    };
+}
+
+#endif // _overlay_hpp
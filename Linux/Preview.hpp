@@ -0,0 +1,348 @@
+#ifndef _preview_hpp
+#define _preview_hpp
+
+#include <libuvc/libuvc.h>
+#include <opencv2/core/core_c.h>
+#include <opencv2/highgui/highgui_c.h>
+#include <opencv2/highgui.hpp>
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstring> // memcpy
+#include <future>
+#include <algorithm>
+#include <functional>
+
+#include "Async.hpp"
+#include "Change.hpp"
+#include "Demand.hpp"
+#include "Convert.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+#include "Overlay.hpp"
+
+namespace Video {
+    /// The OpenCV preview window.
+    ///
+    /// Keeps a persistent BGR image between frames: with static detection on,
+    /// only tiles whose YUYV input changed get reconverted, and frames with
+    /// no changes at all are neither converted nor redrawn.
+    ///
+    /// The preview is the consumer of the Converted stage. It only registers
+    /// demand while its window is actually visible: closed, hidden, switched
+    /// off or headless previews get no frames, and only pump window events
+    /// now and then so they notice when they come back.
+    ///
+    /// highgui isn't safe to drive from more than one thread with GTK or Qt
+    /// behind it, so the window belongs to the preview's own thread and
+    /// every highgui call happens there. present(), refresh() and idle()
+    /// hand their work over and wait for it. presentAt() doesn't wait: the
+    /// second of a pair of doubled frames is due half a frame later, and the
+    /// capture thread shouldn't sit waiting for it.
+    struct Preview {
+        std::string window;
+        bool skipStatic;
+        bool headless;
+        Demand::Consumer display;
+        std::atomic<bool> enabled{true};
+        std::atomic<bool> reopen{false};
+        // The rest is only touched on the window's thread.
+        bool windowOpen = false;
+        bool windowVisible = true;
+        Metrics::Clock::time_point lastPoll;
+        Metrics::Clock::time_point lastPump;
+
+        ChangeDetector changes;
+        std::vector<uint8_t> bgr;
+        int width = 0;
+        int height = 0;
+        IplImage *image = NULL;
+        std::vector<Overlay*> overlays;
+        std::vector<uint8_t> saved;
+
+        Metrics::Counter frames{"video.frames"};
+        Metrics::Counter skipped{"video.static_skipped"};
+        Metrics::Counter tilesConverted{"video.tiles_converted"};
+        Metrics::Counter tilesTotal{"video.tiles_total"};
+        Metrics::Timer hashTime{"video.hash"};
+        Metrics::Timer convertTime{"video.convert"};
+        Metrics::Timer presentTime{"video.present"};
+        Metrics::Timer lateTime{"video.second_field_late"};
+        Metrics::Counter hidden{"video.hidden_skipped"};
+
+        Preview(Demand &demand, std::string window, bool skipStatic = true, bool headless = false): window(window), skipStatic(skipStatic), headless(headless), display(demand, Stage::Converted, !headless) {}
+
+        ~Preview() {
+            settle();
+            if (image) {
+                cvReleaseImageHeader(&image);
+            }
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Preview(Preview const&) = delete;
+        Preview& operator=(Preview const&) = delete;
+
+        /// Converts and shows a frame, waiting up to `wait` ms for a key.
+        /// Returns the key pressed, if any, like cvWaitKey.
+        int present(uvc_frame_t *frame, int wait = 10) {
+            return orLaterKey(onWindow([&]() { return draw(frame, wait); }));
+        }
+
+        /// Shows `frame` at `due` and returns straight away. Its data has to
+        /// stay put until settle(). A key pressed meanwhile comes back from
+        /// the next present() or idle().
+        void presentAt(uvc_frame_t *frame, Metrics::Clock::time_point due) {
+            presenter.post([this, shown = *frame, due]() mutable {
+                Trace::nameThread("preview");
+                std::this_thread::sleep_until(due);
+                lateTime.record(Metrics::nanosecondsSince(due));
+                Trace::Span span("video.second_field");
+                auto key = draw(&shown, 1);
+                if (key != -1) {
+                    laterKey = key;
+                }
+            });
+        }
+
+        /// Waits until a frame passed to presentAt() has been shown.
+        void settle() {
+            onWindow([]() { return -1; });
+        }
+
+        void addOverlay(Overlay *overlay) {
+            overlays.push_back(overlay);
+        }
+
+        /// Whether frames should be converted and presented right now.
+        bool wanted() {
+            return display.active;
+        }
+
+        /// Switches the window on or off; safe from any thread. Switching on
+        /// also brings back a window the user closed.
+        void setEnabled(bool on) {
+            enabled = on;
+            if (on) {
+                reopen = true;
+            }
+        }
+
+        /// Re-evaluates whether anyone can see the window. Call on the
+        /// capture thread once per frame.
+        void refresh() {
+            if (headless) {
+                return;
+            }
+            onWindow([this]() { poll(); return -1; });
+        }
+
+        /// Stands in for present() while nobody is watching: no conversion,
+        /// just an occasional event pump. Returns a key like cvWaitKey.
+        int idle() {
+            hidden.add();
+            if (headless) {
+                return orLaterKey(-1);
+            }
+            return orLaterKey(onWindow([this]() { return pump(); }));
+        }
+
+    private:
+        std::atomic<int> laterKey{-1};
+        // Last, so it's joined before anything it uses goes away.
+        Async::Worker presenter;
+
+        /// Runs `body` on the window's thread and waits for what it returns.
+        /// Anything presentAt() queued goes first.
+        int onWindow(const std::function<int()> &body) {
+            std::promise<int> done;
+            auto result = done.get_future();
+            presenter.post([&]() {
+                Trace::nameThread("preview");
+                done.set_value(body());
+            });
+            return result.get();
+        }
+
+        /// `key`, or failing that one pressed during a presentAt().
+        int orLaterKey(int key) {
+            int waiting = laterKey.exchange(-1);
+            return key != -1 ? key : waiting;
+        }
+
+        /// refresh(), on the window's thread.
+        void poll() {
+            auto now = Metrics::Clock::now();
+            bool on = enabled;
+            bool wasShown = display.active;
+            if (reopen.exchange(false)) {
+                windowOpen = false;
+                windowVisible = true;
+                changes.invalidate();
+            }
+            if (!on && windowOpen) {
+                cvDestroyWindow(window.c_str());
+                windowOpen = false;
+            }
+            if (on && windowOpen && now - lastPoll > std::chrono::milliseconds(250)) {
+                lastPoll = now;
+                windowVisible = cv::getWindowProperty(window, cv::WND_PROP_VISIBLE) > 0;
+            }
+            display.set(on && windowVisible);
+            if (display.active && !wasShown) {
+                // Hashes stopped updating while hidden, and a static picture
+                // would otherwise never be drawn into the new window.
+                changes.invalidate();
+            }
+        }
+
+        /// idle(), on the window's thread.
+        int pump() {
+            if (!windowOpen) {
+                return -1;
+            }
+            auto now = Metrics::Clock::now();
+            if (now - lastPump < std::chrono::milliseconds(100)) {
+                return -1;
+            }
+            lastPump = now;
+            return cvWaitKey(1);
+        }
+
+        int draw(uvc_frame_t *frame, int wait) {
+            frames.add();
+            resize(frame->width, frame->height);
+
+            bool overlaysChanged = false;
+            for (auto overlay: overlays) {
+                overlaysChanged |= overlay->changed();
+            }
+
+            if (!convert(frame) && !overlaysChanged) {
+                skipped.add();
+                return cvWaitKey(wait);
+            }
+
+            Metrics::Scope scope(presentTime);
+            Trace::Span span("video.present");
+            show();
+            return cvWaitKey(wait);
+        }
+
+        void show() {
+            size_t step = width * 3;
+            std::vector<Overlay::Rect> drawn;
+            for (auto overlay: overlays) {
+                if (!overlay->visible()) {
+                    continue;
+                }
+                auto rect = overlay->rect(width, height);
+                if (rect.x < 0 || rect.y < 0) {
+                    continue;
+                }
+                rect.width = std::max(0, std::min(rect.width, width - rect.x));
+                rect.height = std::max(0, std::min(rect.height, height - rect.y));
+                if (rect.width <= 0 || rect.height <= 0) {
+                    continue;
+                }
+                save(rect);
+                overlay->draw(bgr.data(), step, rect);
+                drawn.push_back(rect);
+            }
+
+            cvShowImage(window.c_str(), image);
+            windowOpen = true;
+
+            // Restore in reverse so overlapping overlays unwind correctly.
+            for (auto it = drawn.rbegin(); it != drawn.rend(); ++it) {
+                restore(*it);
+            }
+        }
+
+        void save(Overlay::Rect rect) {
+            size_t rowBytes = rect.width * 3;
+            auto offset = saved.size();
+            saved.resize(offset + rowBytes * rect.height);
+            for (int y = 0; y < rect.height; y += 1) {
+                memcpy(&saved[offset + y * rowBytes], &bgr[((rect.y + y) * width + rect.x) * 3], rowBytes);
+            }
+        }
+
+        void restore(Overlay::Rect rect) {
+            size_t rowBytes = rect.width * 3;
+            auto offset = saved.size() - rowBytes * rect.height;
+            for (int y = 0; y < rect.height; y += 1) {
+                memcpy(&bgr[((rect.y + y) * width + rect.x) * 3], &saved[offset + y * rowBytes], rowBytes);
+            }
+            saved.resize(offset);
+        }
+
+        void resize(int frameWidth, int frameHeight) {
+            if (frameWidth == width && frameHeight == height) {
+                return;
+            }
+            width = frameWidth;
+            height = frameHeight;
+            bgr.assign(width * height * 3, 0);
+            if (image) {
+                cvReleaseImageHeader(&image);
+            }
+            image = cvCreateImageHeader(cvSize(width, height), IPL_DEPTH_8U, 3);
+            cvSetData(image, bgr.data(), width * 3);
+            changes.invalidate();
+        }
+
+        /// Returns false if the frame was identical to the previous one.
+        bool convert(uvc_frame_t *frame) {
+            if (frame->frame_format != UVC_FRAME_FORMAT_YUYV) {
+                // Anything else goes through libuvc, whole frame every time.
+                Metrics::Scope scope(convertTime);
+                Trace::Span span("video.convert");
+                uvc_frame_t out = {};
+                out.data = bgr.data();
+                out.data_bytes = bgr.size();
+                out.library_owns_data = 0;
+                auto ret = uvc_any2bgr(frame, &out);
+                if (ret) {
+                    uvc_perror(ret, "uvc_any2bgr");
+                }
+                return true;
+            }
+
+            auto data = (const uint8_t *)frame->data;
+            size_t step = frame->step ? frame->step : width * 2;
+
+            if (!skipStatic) {
+                Metrics::Scope scope(convertTime);
+                Trace::Span span("video.convert");
+                Convert::yuyvToBgr(data, step, bgr.data(), width * 3, 0, width, 0, height);
+                return true;
+            }
+
+            int dirty;
+            {
+                Metrics::Scope scope(hashTime);
+                Trace::Span span("video.hash");
+                dirty = changes.update(data, step, width, height);
+            }
+            tilesTotal.add(changes.tileCount());
+            if (!dirty) {
+                return false;
+            }
+
+            Metrics::Scope scope(convertTime);
+            Trace::Span span("video.convert", dirty);
+            for (auto &tile: changes.dirty) {
+                Convert::yuyvToBgr(data, step, bgr.data(), width * 3, tile.x0, tile.x1, tile.y0, tile.y1);
+            }
+            tilesConverted.add(dirty);
+            return true;
+        }
+    };
+}
+
+#endif // _preview_hpp
@@ -0,0 +1,677 @@
+#ifndef _record_hpp
+#define _record_hpp
+
+#include <libuvc/libuvc.h>
+
+#include <map>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+
+#include "Async.hpp"
+#include "Codec.hpp"
+#include "Frame.hpp"
+#include "Demand.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+/// Lossless recordings: a header, one record per frame, and an index of
+/// frame offsets and timestamps at the end so players can seek.
+///
+/// YUYV frames go through Codec; anything else (MJPEG, or a YUYV frame the
+/// codec couldn't shrink) is stored as is. If the index is missing because
+/// the recorder never got to finish, Reader rebuilds it by walking the
+/// frame records.
+namespace Record {
+    enum class Encoding: uint8_t {
+        Stored = 0,
+        Yuyv = 1,
+    };
+
+    struct FileHeader {
+        char magic[4];
+        uint32_t version;
+    };
+
+    struct FrameHeader {
+        char magic[4];
+        uint8_t encoding;
+        uint8_t reserved[3];
+        uint32_t format;
+        uint32_t sequence;
+        uint16_t width;
+        uint16_t height;
+        uint32_t step;
+        uint64_t timestamp; // nanoseconds since the recording started
+        uint32_t rawBytes;
+        uint32_t payloadBytes;
+    };
+
+    struct IndexEntry {
+        uint64_t offset;
+        uint64_t timestamp;
+    };
+
+    struct Trailer {
+        uint64_t indexOffset;
+        uint64_t count;
+        char magic[8];
+    };
+
+    static_assert(sizeof(FileHeader) == 8, "FileHeader must be packed");
+    static_assert(sizeof(FrameHeader) == 40, "FrameHeader must be packed");
+    static_assert(sizeof(Trailer) == 24, "Trailer must be packed");
+
+    static const char fileMagic[4] = {'U', 'V', 'C', 'R'};
+    static const char frameMagic[4] = {'U', 'V', 'C', 'F'};
+    static const char indexMagic[8] = {'U', 'V', 'C', 'R', 'I', 'D', 'X', 0};
+    static const uint32_t version = 2;
+
+    /// Nothing UVC delivers comes close; anything bigger is a corrupt header.
+    static const uint32_t maxFrameBytes = 256u << 20;
+
+    /// Describes a frame about to be encoded.
+    inline FrameHeader describe(uvc_frame_t *frame, uint64_t timestamp) {
+        FrameHeader header = {};
+        memcpy(header.magic, frameMagic, 4);
+        header.format = frame->frame_format;
+        header.sequence = frame->sequence;
+        header.width = frame->width;
+        header.height = frame->height;
+        header.step = frame->step ? frame->step : frame->data_bytes / std::max<uint32_t>(frame->height, 1);
+        header.timestamp = timestamp;
+        header.rawBytes = frame->data_bytes;
+        return header;
+    }
+
+    inline FrameHeader describe(const Video::Frame &frame, uint64_t timestamp) {
+        FrameHeader header = {};
+        memcpy(header.magic, frameMagic, 4);
+        header.format = frame.format;
+        header.sequence = frame.sequence;
+        header.width = frame.width;
+        header.height = frame.height;
+        header.step = frame.step;
+        header.timestamp = timestamp;
+        header.rawBytes = frame.bytes;
+        return header;
+    }
+
+    inline bool compressible(const FrameHeader &header) {
+        return header.format == UVC_FRAME_FORMAT_YUYV
+            && header.width > 0
+            && header.step >= (uint64_t)header.width * 2
+            && (uint64_t)header.step * header.height <= header.rawBytes;
+    }
+
+    /// The most encode() can write for this frame.
+    inline size_t maxPayload(const FrameHeader &header) {
+        if (!compressible(header)) {
+            return header.rawBytes;
+        }
+        return std::max<size_t>(header.rawBytes, Codec::bound(header.width * 2, header.height));
+    }
+
+    /// Compresses `data` into `out`, which must hold maxPayload(header), and
+    /// fills in the header's encoding and payload size.
+    inline void encode(FrameHeader &header, const uint8_t *data, uint8_t *out) {
+        if (compressible(header)) {
+            auto bytes = Codec::compress(data, header.step, header.width * 2, header.height, out);
+            if (bytes < header.rawBytes) {
+                header.encoding = (uint8_t)Encoding::Yuyv;
+                header.payloadBytes = bytes;
+                return;
+            }
+        }
+        memcpy(out, data, header.rawBytes);
+        header.encoding = (uint8_t)Encoding::Stored;
+        header.payloadBytes = header.rawBytes;
+    }
+
+    /// Reverses encode() into `frame`, growing it if it's too small. Decoded
+    /// YUYV rows are packed, so step is always width * 2 for those.
+    inline bool decode(const FrameHeader &header, const uint8_t *payload, Video::Frame &frame) {
+        frame.width = header.width;
+        frame.height = header.height;
+        frame.format = (uvc_frame_format)header.format;
+        frame.sequence = header.sequence;
+        frame.captureTime.tv_sec = header.timestamp / 1000000000ull;
+        frame.captureTime.tv_usec = header.timestamp / 1000 % 1000000;
+
+        if (header.encoding == (uint8_t)Encoding::Stored) {
+            if (frame.data.size() < header.payloadBytes) {
+                frame.data.resize(header.payloadBytes);
+            }
+            memcpy(frame.data.data(), payload, header.payloadBytes);
+            frame.bytes = header.payloadBytes;
+            frame.step = header.step;
+            return true;
+        }
+        if (header.encoding != (uint8_t)Encoding::Yuyv || !compressible(header)) {
+            return false;
+        }
+        size_t rowBytes = header.width * 2;
+        if (frame.data.size() < rowBytes * header.height) {
+            frame.data.resize(rowBytes * header.height);
+        }
+        frame.bytes = rowBytes * header.height;
+        frame.step = rowBytes;
+        return Codec::decompress(payload, header.payloadBytes, frame.data.data(), rowBytes, rowBytes, header.height);
+    }
+
+    /// Borrows a frame as a libuvc frame, for feeding recordings through the
+    /// same path as live capture.
+    inline uvc_frame_t view(Video::Frame &frame) {
+        uvc_frame_t out = {};
+        out.data = frame.data.data();
+        out.data_bytes = frame.bytes;
+        out.width = frame.width;
+        out.height = frame.height;
+        out.step = frame.step;
+        out.frame_format = frame.format;
+        out.sequence = frame.sequence;
+        out.capture_time = frame.captureTime;
+        out.library_owns_data = 1;
+        return out;
+    }
+
+    /// Appends frame records to a file and writes the index on finish().
+    /// Not thread safe; Recorder only writes from its output thread.
+    struct Writer {
+        FILE *file = NULL;
+        std::string path;
+        std::vector<IndexEntry> index;
+        uint64_t offset = 0;
+        bool failed = false;
+
+        Writer(std::string path): path(path) {
+            file = fopen(path.c_str(), "wb");
+            if (!file) {
+                throw std::runtime_error("Couldn't open " + path + " for writing.");
+            }
+            FileHeader header = {};
+            memcpy(header.magic, fileMagic, 4);
+            header.version = version;
+            put(&header, sizeof header);
+        }
+
+        ~Writer() {
+            finish();
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Writer(Writer const&) = delete;
+        Writer& operator=(Writer const&) = delete;
+
+        void write(const FrameHeader &header, const uint8_t *payload) {
+            index.push_back({offset, header.timestamp});
+            put(&header, sizeof header);
+            put(payload, header.payloadBytes);
+        }
+
+        /// Writes the index and closes the file. Returns false if anything
+        /// failed to write along the way.
+        bool finish() {
+            if (!file) {
+                return !failed;
+            }
+            Trailer trailer = {};
+            trailer.indexOffset = offset;
+            trailer.count = index.size();
+            memcpy(trailer.magic, indexMagic, 8);
+            put(index.data(), index.size() * sizeof(IndexEntry));
+            put(&trailer, sizeof trailer);
+            if (fclose(file) != 0) {
+                failed = true;
+            }
+            file = NULL;
+            return !failed;
+        }
+
+    private:
+        void put(const void *data, size_t bytes) {
+            if (fwrite(data, 1, bytes, file) != bytes) {
+                failed = true;
+            }
+            offset += bytes;
+        }
+    };
+
+    /// Compresses frames from the capture thread on a pool of threads and
+    /// writes them out in order.
+    ///
+    /// capture() only copies into a pooled frame; if every pooled frame is
+    /// still waiting to be compressed the frame is dropped and counted rather
+    /// than holding up libuvc. Compressed payload buffers are recycled, so
+    /// once the pipeline is full no frame-sized allocations happen; each
+    /// frame still costs a few small ones for its tasks and its place in
+    /// the reorder map.
+    struct Recorder {
+        struct Encoded {
+            FrameHeader header;
+            std::vector<uint8_t> payload;
+        };
+
+        std::string path;
+        Writer writer;
+        Video::Demand::Consumer raw;
+        Video::FramePool pool;
+        Metrics::Clock::time_point start;
+        uint32_t captured = 0;
+
+        std::mutex spareMutex;
+        std::vector<std::vector<uint8_t>> spare;
+
+        // Only touched on the output thread.
+        std::map<uint32_t, Encoded> waiting;
+        uint32_t nextToWrite = 0;
+
+        Metrics::Counter frames{"record.frames"};
+        Metrics::Counter dropped{"record.dropped"};
+        Metrics::Counter bytesIn{"record.bytes_in"};
+        Metrics::Counter bytesOut{"record.bytes_out"};
+        Metrics::Timer encodeTime{"record.encode"};
+        Metrics::Timer writeTime{"record.write"};
+
+        std::unique_ptr<Async::Worker> output;
+        std::unique_ptr<Async::Pool> compressors;
+
+        Recorder(Video::Demand &demand, std::string path, size_t threads, size_t frameCapacity):
+            path(path),
+            writer(path),
+            raw(demand, Video::Stage::Raw, true),
+            pool(2 * std::max<size_t>(threads, 1) + 2, frameCapacity),
+            start(Metrics::Clock::now()),
+            output(new Async::Worker()),
+            compressors(new Async::Pool(threads)) {}
+
+        /// Finishes every frame already captured, then writes the index.
+        ~Recorder() {
+            raw.set(false);
+            compressors.reset();
+            output.reset();
+            writer.finish();
+
+            auto in = bytesIn.value.load(), out = bytesOut.value.load();
+            fprintf(stderr, "Recorded %llu frames to %s (%.1f MB, %.2fx smaller, %.2fms average encode, %llu dropped).\n",
+                (unsigned long long)frames.value.load(), path.c_str(), out / 1e6, out ? (double)in / out : 0.0,
+                encodeTime.averageMs(), (unsigned long long)dropped.value.load());
+            if (writer.failed) {
+                fprintf(stderr, "Some frames failed to write to %s.\n", path.c_str());
+            }
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Recorder(Recorder const&) = delete;
+        Recorder& operator=(Recorder const&) = delete;
+
+        /// Called on the capture thread only.
+        void capture(uvc_frame_t *frame) {
+            auto timestamp = Metrics::nanosecondsSince(start);
+            auto pooled = pool.acquire();
+            if (!pooled || !pooled->copyFrom(frame)) {
+                dropped.add();
+                Trace::instant("record.dropped");
+                return;
+            }
+            auto index = captured++;
+            compressors->post([this, pooled, index, timestamp]() {
+                compress(*pooled, index, timestamp);
+            });
+        }
+
+    private:
+        void compress(Video::Frame &frame, uint32_t index, uint64_t timestamp) {
+            Trace::nameThread("record");
+            Trace::Span span("record.encode", index);
+            auto encoded = std::make_shared<Encoded>();
+            encoded->header = describe(frame, timestamp);
+            encoded->payload = takeSpare();
+            if (encoded->payload.size() < maxPayload(encoded->header)) {
+                encoded->payload.resize(maxPayload(encoded->header));
+            }
+            {
+                Metrics::Scope scope(encodeTime);
+                encode(encoded->header, frame.data.data(), encoded->payload.data());
+            }
+            output->post([this, encoded, index]() {
+                waiting.emplace(index, std::move(*encoded));
+                flush();
+            });
+        }
+
+        /// Writes every frame that's next in line.
+        void flush() {
+            for (auto it = waiting.find(nextToWrite); it != waiting.end(); it = waiting.find(nextToWrite)) {
+                {
+                    Metrics::Scope scope(writeTime);
+                    writer.write(it->second.header, it->second.payload.data());
+                }
+                frames.add();
+                bytesIn.add(it->second.header.rawBytes);
+                bytesOut.add(sizeof(FrameHeader) + it->second.header.payloadBytes);
+                giveSpare(std::move(it->second.payload));
+                waiting.erase(it);
+                nextToWrite += 1;
+            }
+        }
+
+        std::vector<uint8_t> takeSpare() {
+            std::lock_guard<std::mutex> lock(spareMutex);
+            if (spare.empty()) {
+                return std::vector<uint8_t>();
+            }
+            auto buffer = std::move(spare.back());
+            spare.pop_back();
+            return buffer;
+        }
+
+        void giveSpare(std::vector<uint8_t> buffer) {
+            std::lock_guard<std::mutex> lock(spareMutex);
+            spare.push_back(std::move(buffer));
+        }
+    };
+
+    /// Random access to a recording. Safe to read from several threads.
+    struct Reader {
+        FILE *file = NULL;
+        std::string path;
+        std::mutex mutex;
+        std::vector<IndexEntry> index;
+        bool rebuilt = false;
+
+        Reader(std::string path): path(path) {
+            file = fopen(path.c_str(), "rb");
+            if (!file) {
+                throw std::runtime_error("Couldn't open " + path + " for reading.");
+            }
+            FileHeader header = {};
+            if (fread(&header, sizeof header, 1, file) != 1 || memcmp(header.magic, fileMagic, 4) != 0) {
+                fclose(file);
+                throw std::runtime_error(path + " is not a recording.");
+            }
+            if (header.version != version) {
+                fclose(file);
+                throw std::runtime_error(path + " is version " + std::to_string(header.version) + ", expected " + std::to_string(version) + ".");
+            }
+            if (!loadIndex()) {
+                rebuildIndex();
+            }
+        }
+
+        ~Reader() {
+            fclose(file);
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Reader(Reader const&) = delete;
+        Reader& operator=(Reader const&) = delete;
+
+        size_t count() {
+            return index.size();
+        }
+
+        uint64_t timestamp(size_t frame) {
+            return index[frame].timestamp;
+        }
+
+        /// The first frame at or after `timestamp`, or the last frame.
+        size_t find(uint64_t timestamp) {
+            auto it = std::lower_bound(index.begin(), index.end(), timestamp, [](const IndexEntry &entry, uint64_t value) {
+                return entry.timestamp < value;
+            });
+            if (it == index.end()) {
+                return index.empty() ? 0 : index.size() - 1;
+            }
+            return it - index.begin();
+        }
+
+        bool read(size_t frame, FrameHeader &header, std::vector<uint8_t> &payload) {
+            if (frame >= index.size()) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (fseeko(file, index[frame].offset, SEEK_SET) != 0 || fread(&header, sizeof header, 1, file) != 1) {
+                return false;
+            }
+            if (memcmp(header.magic, frameMagic, 4) != 0) {
+                return false;
+            }
+            // Sizes come straight from the file; don't allocate on their word.
+            if (header.rawBytes > maxFrameBytes || header.payloadBytes > maxPayload(header)) {
+                return false;
+            }
+            if (payload.size() < header.payloadBytes) {
+                payload.resize(header.payloadBytes);
+            }
+            return fread(payload.data(), 1, header.payloadBytes, file) == header.payloadBytes;
+        }
+
+        /// Reads and decodes a frame. `scratch` holds the compressed bytes
+        /// and is reused between calls.
+        bool read(size_t frame, Video::Frame &out, std::vector<uint8_t> &scratch) {
+            FrameHeader header;
+            return read(frame, header, scratch) && decode(header, scratch.data(), out);
+        }
+
+    private:
+        bool loadIndex() {
+            Trailer trailer = {};
+            if (fseeko(file, -(off_t)sizeof trailer, SEEK_END) != 0 || fread(&trailer, sizeof trailer, 1, file) != 1) {
+                return false;
+            }
+            if (memcmp(trailer.magic, indexMagic, 8) != 0) {
+                return false;
+            }
+            auto end = ftello(file);
+            if (trailer.indexOffset + trailer.count * sizeof(IndexEntry) + sizeof trailer != (uint64_t)end) {
+                return false;
+            }
+            index.resize(trailer.count);
+            return fseeko(file, trailer.indexOffset, SEEK_SET) == 0
+                && fread(index.data(), sizeof(IndexEntry), index.size(), file) == index.size();
+        }
+
+        /// Walks the frame records from the start, stopping at the first one
+        /// that's cut off.
+        void rebuildIndex() {
+            rebuilt = true;
+            index.clear();
+            uint64_t offset = sizeof(FileHeader);
+            FrameHeader header;
+            while (fseeko(file, offset, SEEK_SET) == 0 && fread(&header, sizeof header, 1, file) == 1) {
+                if (memcmp(header.magic, frameMagic, 4) != 0) {
+                    break;
+                }
+                if (fseeko(file, header.payloadBytes, SEEK_CUR) != 0 || ftello(file) > fileSize()) {
+                    break;
+                }
+                index.push_back({offset, header.timestamp});
+                offset += sizeof header + header.payloadBytes;
+            }
+        }
+
+        off_t fileSize() {
+            auto position = ftello(file);
+            fseeko(file, 0, SEEK_END);
+            auto size = ftello(file);
+            fseeko(file, position, SEEK_SET);
+            return size;
+        }
+    };
+
+    /// Plays a recording back in real time through a callback with the same
+    /// shape as libuvc's, so recordings go through the live pipeline.
+    ///
+    /// Frames are decoded a few ahead on a pool of threads. While paused (or
+    /// after the last frame) the current frame is delivered again every
+    /// 100ms so the preview keeps handling keys.
+    struct Player {
+        typedef std::function<void(uvc_frame_t*)> Callback;
+
+        struct Pending {
+            size_t index;
+            Video::FrameRef frame;
+            std::future<bool> decoded;
+        };
+
+        Reader &reader;
+        Callback deliver;
+        size_t lookahead;
+        Video::FramePool pool;
+        std::atomic<bool> paused{false};
+        std::atomic<bool> stopping{false};
+        std::atomic<int64_t> seekTo{-1};
+        std::atomic<uint64_t> position{0};
+        Metrics::Counter played{"play.frames"};
+        Metrics::Counter late{"play.late"};
+        Metrics::Timer decodeTime{"play.decode"};
+        std::unique_ptr<Async::Pool> decoders;
+        std::thread thread;
+
+        Player(Reader &reader, Callback deliver, size_t threads):
+            reader(reader),
+            deliver(deliver),
+            lookahead(2 * std::max<size_t>(threads, 1)),
+            pool(lookahead + 1, firstFrameBytes(reader)),
+            decoders(new Async::Pool(threads)) {
+            thread = std::thread([this](){ run(); });
+        }
+
+        ~Player() {
+            stopping = true;
+            thread.join();
+            decoders.reset();
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Player(Player const&) = delete;
+        Player& operator=(Player const&) = delete;
+
+        void setPaused(bool on) {
+            paused = on;
+        }
+
+        /// Jumps to the first frame at or after `timestamp` nanoseconds.
+        void seek(uint64_t timestamp) {
+            seekTo = (int64_t)timestamp;
+        }
+
+        uint64_t duration() {
+            return reader.count() ? reader.timestamp(reader.count() - 1) : 0;
+        }
+
+    private:
+        static size_t firstFrameBytes(Reader &reader) {
+            FrameHeader header;
+            std::vector<uint8_t> payload;
+            if (!reader.count() || !reader.read(0, header, payload)) {
+                return 0;
+            }
+            return std::max<size_t>(header.rawBytes, header.width * 2u * header.height);
+        }
+
+        void run() {
+            std::deque<Pending> queue;
+            size_t next = 0;
+            bool rebase = true;
+            auto wallStart = Metrics::Clock::now();
+            uint64_t mediaStart = 0;
+            Video::FrameRef last;
+            auto lastDelivered = wallStart;
+
+            while (!stopping) {
+                auto target = seekTo.exchange(-1);
+                if (target >= 0) {
+                    for (auto &pending: queue) {
+                        pending.decoded.wait();
+                    }
+                    queue.clear();
+                    next = reader.find(target);
+                    rebase = true;
+                }
+
+                while (queue.size() < lookahead && next < reader.count()) {
+                    auto frame = pool.acquire();
+                    if (!frame) {
+                        break;
+                    }
+                    queue.push_back(decodeAhead(next, frame));
+                    next += 1;
+                }
+
+                if (paused || queue.empty()) {
+                    rebase = true;
+                    auto now = Metrics::Clock::now();
+                    if (last && now - lastDelivered > std::chrono::milliseconds(100)) {
+                        auto view = Record::view(*last);
+                        deliver(&view);
+                        lastDelivered = now;
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    continue;
+                }
+
+                auto pending = std::move(queue.front());
+                queue.pop_front();
+                if (!pending.decoded.get()) {
+                    fprintf(stderr, "Skipping unreadable frame %zu.\n", pending.index);
+                    continue;
+                }
+
+                auto timestamp = reader.timestamp(pending.index);
+                if (rebase) {
+                    wallStart = Metrics::Clock::now();
+                    mediaStart = timestamp;
+                    rebase = false;
+                }
+                auto due = wallStart + std::chrono::nanoseconds(timestamp - mediaStart);
+                auto now = Metrics::Clock::now();
+                if (now > due + std::chrono::milliseconds(100)) {
+                    // Decoding can't keep up; slip rather than race to catch up.
+                    late.add();
+                    wallStart += now - due;
+                } else {
+                    std::this_thread::sleep_until(due);
+                }
+
+                auto view = Record::view(*pending.frame);
+                deliver(&view);
+                played.add();
+                position = timestamp;
+                last = pending.frame;
+                lastDelivered = Metrics::Clock::now();
+            }
+
+            for (auto &pending: queue) {
+                pending.decoded.wait();
+            }
+        }
+
+        Pending decodeAhead(size_t index, Video::FrameRef frame) {
+            auto done = std::make_shared<std::promise<bool>>();
+            Pending pending = {index, frame, done->get_future()};
+            decoders->post([this, index, frame, done]() {
+                Trace::nameThread("decode");
+                Trace::Span span("play.decode", index);
+                thread_local std::vector<uint8_t> scratch;
+                Metrics::Scope scope(decodeTime);
+                done->set_value(reader.read(index, *frame, scratch));
+            });
+            return pending;
+        }
+    };
+}
+
+#endif // _record_hpp
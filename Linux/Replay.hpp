@@ -0,0 +1,748 @@
+#ifndef _replay_hpp
+#define _replay_hpp
+
+#include <libuvc/libuvc.h>
+#include <soundio/soundio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+
+#include "Ring.hpp"
+#include "Frame.hpp"
+#include "Demand.hpp"
+#include "Record.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+/// Instant replay: the last N seconds of video and audio, kept in memory.
+///
+/// Frames are compressed with the recording codec into one fixed arena and
+/// the oldest are evicted to make room, so memory never grows past the
+/// budget. The budget can move, say with the video mode, but never past
+/// what was reserved up front. Audio is copied from the capture ring into a
+/// fixed PCM ring. Nothing allocates per frame: frames reach the encoder
+/// through a few preallocated slots and are compressed straight into the
+/// arena.
+namespace Replay {
+    /// Compressed frames in a fixed arena, oldest first. Each frame is a
+    /// Record::FrameHeader followed by its payload, so dumping is a copy.
+    ///
+    /// Frames are addressed by serial, which only ever grows; a serial that
+    /// has been evicted simply isn't found anymore.
+    struct Store {
+        struct Entry {
+            size_t offset;
+            size_t bytes;
+            uint64_t timestamp;
+        };
+
+        std::mutex mutex;
+        uint8_t *arena;
+        size_t reserved;
+        size_t limit;
+        size_t nextLimit;
+        std::vector<Entry> entries;
+        size_t first = 0;
+        size_t count = 0;
+        uint64_t firstSerial = 0;
+        size_t head = 0;
+        size_t usedBytes = 0;
+        uint64_t window;
+
+        /// Address space for `reserved` bytes (at least `bytes`) is set aside
+        /// up front, but only the first `bytes` are used, and pages are only
+        /// backed by memory once a frame lands on them.
+        Store(size_t bytes, size_t maxFrames, uint64_t window, size_t reserved = 0):
+            reserved(std::max(bytes, reserved)),
+            limit(align(bytes, false)),
+            nextLimit(limit),
+            entries(std::max<size_t>(maxFrames, 1)),
+            window(window) {
+            auto address = mmap(NULL, this->reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (address == MAP_FAILED) {
+                throw std::runtime_error("Couldn't reserve " + std::to_string(this->reserved / 1000000) + " MB for replay.");
+            }
+            arena = (uint8_t*)address;
+        }
+
+        ~Store() {
+            munmap(arena, reserved);
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Store(Store const&) = delete;
+        Store& operator=(Store const&) = delete;
+
+        /// Grows or shrinks the part in use, within what was reserved. Takes
+        /// effect at the next reserve(), so never under a frame being
+        /// written; shrinking drops the frames that no longer fit and hands
+        /// their memory back.
+        void resize(size_t bytes) {
+            std::lock_guard<std::mutex> lock(mutex);
+            nextLimit = align(std::min(bytes, reserved), false);
+        }
+
+        /// Makes room for `bytes` at the head, evicting the oldest frames
+        /// that are in the way. Returns NULL if it can never fit. Only the
+        /// single writer calls this, followed by commit().
+        uint8_t* reserve(size_t bytes) {
+            bytes = align(bytes);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (nextLimit != limit) {
+                applyLimit();
+            }
+            if (bytes > limit) {
+                return NULL;
+            }
+            if (head + bytes > limit) {
+                // Whatever is left past the head belongs to the previous lap.
+                while (count && oldest().offset >= head) {
+                    evict();
+                }
+                head = 0;
+            }
+            while (count && oldest().offset >= head && oldest().offset < head + bytes) {
+                evict();
+            }
+            if (count == entries.size()) {
+                evict();
+            }
+            return arena + head;
+        }
+
+        /// Publishes the frame written at the last reserve(), and drops
+        /// frames that have aged out of the window.
+        void commit(size_t bytes, uint64_t timestamp) {
+            bytes = align(bytes);
+            std::lock_guard<std::mutex> lock(mutex);
+            entries[(first + count) % entries.size()] = {head, bytes, timestamp};
+            count += 1;
+            usedBytes += bytes;
+            head += bytes;
+            while (count > 1 && timestamp - oldest().timestamp > window) {
+                evict();
+            }
+        }
+
+        /// Copies a frame out. False if it's been evicted or isn't there yet.
+        bool copy(uint64_t serial, Record::FrameHeader &header, std::vector<uint8_t> &payload) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (serial < firstSerial || serial >= firstSerial + count) {
+                return false;
+            }
+            auto &entry = entries[(first + (serial - firstSerial)) % entries.size()];
+            memcpy(&header, arena + entry.offset, sizeof header);
+            if (payload.size() < header.payloadBytes) {
+                payload.resize(header.payloadBytes);
+            }
+            memcpy(payload.data(), arena + entry.offset + sizeof header, header.payloadBytes);
+            return true;
+        }
+
+        /// Oldest serial and one past the newest.
+        std::pair<uint64_t, uint64_t> range() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return {firstSerial, firstSerial + count};
+        }
+
+        /// The first serial at or after `timestamp`, or one past the newest.
+        uint64_t find(uint64_t timestamp) {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t low = 0, high = count;
+            while (low < high) {
+                auto middle = (low + high) / 2;
+                if (entries[(first + middle) % entries.size()].timestamp < timestamp) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            return firstSerial + low;
+        }
+
+        uint64_t timestamp(uint64_t serial) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (serial < firstSerial || serial >= firstSerial + count) {
+                return 0;
+            }
+            return entries[(first + (serial - firstSerial)) % entries.size()].timestamp;
+        }
+
+    private:
+        static size_t align(size_t bytes, bool up = true) {
+            return up ? (bytes + 7) & ~(size_t)7 : bytes & ~(size_t)7;
+        }
+
+        void applyLimit() {
+            if (nextLimit < limit) {
+                // Everything up to the newest frame that sticks out goes.
+                size_t doomed = 0;
+                for (size_t i = 0; i < count; i += 1) {
+                    auto &entry = entries[(first + i) % entries.size()];
+                    if (entry.offset + entry.bytes > nextLimit) {
+                        doomed = i + 1;
+                    }
+                }
+                while (doomed--) {
+                    evict();
+                }
+                if (head > nextLimit) {
+                    head = 0;
+                }
+                size_t page = sysconf(_SC_PAGESIZE);
+                size_t keep = (nextLimit + page - 1) / page * page;
+                if (keep < reserved) {
+                    madvise(arena + keep, reserved - keep, MADV_DONTNEED);
+                }
+            }
+            limit = nextLimit;
+        }
+
+        Entry& oldest() {
+            return entries[first];
+        }
+
+        void evict() {
+            usedBytes -= oldest().bytes;
+            first = (first + 1) % entries.size();
+            count -= 1;
+            firstSerial += 1;
+        }
+    };
+
+    /// The last `seconds` of captured audio, fed from a lossy reader on the
+    /// capture ring so it can never hold playback up.
+    struct AudioTrack {
+        ::Audio::Ring &ring;
+        int reader;
+        SoundIoFormat format;
+        int sampleRate;
+        int channels;
+        size_t bytesPerFrame;
+        Metrics::Clock::time_point epoch;
+
+        std::mutex mutex;
+        std::vector<uint8_t> pcm;
+        size_t capacity;
+        uint64_t total = 0;
+        uint64_t anchorFrames = 0;
+        uint64_t anchorTime = 0;
+
+        std::vector<uint8_t> chunk;
+        uint64_t consumed;
+        std::atomic<bool> stopping{false};
+        Metrics::Counter skipped{"replay.audio_skipped"};
+        std::thread thread;
+
+        AudioTrack(::Audio::Ring &ring, SoundIoFormat format, int sampleRate, int channels, double seconds, Metrics::Clock::time_point epoch):
+            ring(ring),
+            reader(ring.addReader(false)),
+            format(format),
+            sampleRate(sampleRate),
+            channels(channels),
+            bytesPerFrame(ring.frameBytes()),
+            epoch(epoch),
+            pcm((size_t)(seconds * sampleRate) * ring.frameBytes()),
+            capacity((size_t)(seconds * sampleRate)),
+            chunk(ring.frameCapacity() * ring.frameBytes()),
+            consumed(ring.readPosition(reader)) {
+            thread = std::thread([this](){ run(); });
+        }
+
+        ~AudioTrack() {
+            stopping = true;
+            thread.join();
+            ring.removeReader(reader);
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        AudioTrack(AudioTrack const&) = delete;
+        AudioTrack& operator=(AudioTrack const&) = delete;
+
+        /// What a track for `seconds` of audio from `ring` will allocate.
+        static size_t memoryFor(::Audio::Ring &ring, int sampleRate, double seconds) {
+            return ((size_t)(seconds * sampleRate) + ring.frameCapacity()) * ring.frameBytes();
+        }
+
+        size_t memory() {
+            return pcm.size() + chunk.size();
+        }
+
+        /// Whether writeWav() can express this sample format.
+        static bool wavFormat(SoundIoFormat format, uint16_t &tag, uint16_t &bits) {
+            switch (format) {
+            case SoundIoFormatU8: tag = 1; bits = 8; return true;
+            case SoundIoFormatS16LE: tag = 1; bits = 16; return true;
+            case SoundIoFormatS32LE: tag = 1; bits = 32; return true;
+            case SoundIoFormatFloat32LE: tag = 3; bits = 32; return true;
+            case SoundIoFormatFloat64LE: tag = 3; bits = 64; return true;
+            default: return false;
+            }
+        }
+
+        /// Writes the audio between two timestamps on the replay clock as
+        /// a WAV file. Returns false if the format has no WAV equivalent or
+        /// the file couldn't be written.
+        bool writeWav(std::string path, uint64_t from, uint64_t to) {
+            uint16_t tag, bits;
+            if (!wavFormat(format, tag, bits)) {
+                return false;
+            }
+
+            // Copy out under the lock and write without it: the audio thread
+            // can't wait on the disk without getting lapped.
+            std::vector<uint8_t> data;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                // Samples are placed in time by the last read: the newest
+                // sample is taken to have arrived then.
+                auto toFrame = [&](uint64_t timestamp) -> uint64_t {
+                    int64_t frames = anchorFrames - (int64_t)((double)((int64_t)anchorTime - (int64_t)timestamp) * sampleRate / 1e9);
+                    int64_t oldest = total > capacity ? total - capacity : 0;
+                    return std::min<int64_t>(std::max<int64_t>(frames, oldest), total);
+                };
+                auto start = toFrame(from), end = toFrame(to);
+                data.resize((end - start) * bytesPerFrame);
+                for (auto frame = start; frame < end;) {
+                    auto offset = frame % capacity;
+                    auto frames = std::min<uint64_t>(end - frame, capacity - offset);
+                    memcpy(data.data() + (frame - start) * bytesPerFrame, pcm.data() + offset * bytesPerFrame, frames * bytesPerFrame);
+                    frame += frames;
+                }
+            }
+
+            FILE *file = fopen(path.c_str(), "wb");
+            if (!file) {
+                return false;
+            }
+            uint32_t dataBytes = data.size();
+            uint32_t byteRate = sampleRate * bytesPerFrame;
+            uint16_t blockAlign = bytesPerFrame, channelCount = channels;
+            uint32_t riffBytes = 36 + dataBytes, formatBytes = 16, rate = sampleRate;
+            fwrite("RIFF", 1, 4, file);
+            fwrite(&riffBytes, 4, 1, file);
+            fwrite("WAVEfmt ", 1, 8, file);
+            fwrite(&formatBytes, 4, 1, file);
+            fwrite(&tag, 2, 1, file);
+            fwrite(&channelCount, 2, 1, file);
+            fwrite(&rate, 4, 1, file);
+            fwrite(&byteRate, 4, 1, file);
+            fwrite(&blockAlign, 2, 1, file);
+            fwrite(&bits, 2, 1, file);
+            fwrite("data", 1, 4, file);
+            fwrite(&dataBytes, 4, 1, file);
+            fwrite(data.data(), 1, data.size(), file);
+            return fclose(file) == 0;
+        }
+
+    private:
+        /// Appends `frames` of `data`, or of silence if it's NULL. Call with
+        /// the mutex held.
+        void append(const uint8_t *data, uint64_t frames) {
+            // Only the last `capacity` frames would survive anyway.
+            for (uint64_t done = frames > capacity ? frames - capacity : 0; done < frames;) {
+                auto offset = (total + done) % capacity;
+                auto count = std::min<uint64_t>(frames - done, capacity - offset);
+                auto target = pcm.data() + offset * bytesPerFrame;
+                if (data) {
+                    memcpy(target, data + done * bytesPerFrame, count * bytesPerFrame);
+                } else {
+                    memset(target, 0, count * bytesPerFrame);
+                }
+                done += count;
+            }
+            total += frames;
+        }
+
+        void run() {
+            Trace::nameThread("replay.audio");
+            size_t chunkFrames = chunk.size() / bytesPerFrame;
+            // Often enough that the lossy reader never gets lapped.
+            auto interval = std::chrono::microseconds((int64_t)(1e6 * ring.frameCapacity() / (4.0 * sampleRate)));
+            while (!stopping) {
+                std::this_thread::sleep_for(std::min<std::chrono::microseconds>(interval, std::chrono::milliseconds(10)));
+                for (;;) {
+                    auto frames = ring.read(reader, chunk.data(), chunkFrames);
+                    // If it did get lapped, whatever it skipped (always ahead
+                    // of what it read) goes in as silence, so the time
+                    // covered still matches the clock and the video.
+                    auto position = ring.readPosition(reader);
+                    auto gap = position - consumed - frames;
+                    consumed = position;
+                    if (!frames && !gap) {
+                        break;
+                    }
+                    skipped.add(gap);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    append(NULL, gap);
+                    append(chunk.data(), frames);
+                    anchorFrames = total;
+                    anchorTime = Metrics::nanosecondsSince(epoch);
+                }
+            }
+        }
+    };
+
+    /// The replay buffer itself: takes frames on the capture thread and
+    /// compresses them into a Store on its own thread.
+    struct Buffer {
+        struct Slot {
+            std::vector<uint8_t> data;
+            Record::FrameHeader header;
+        };
+
+        double seconds;
+        size_t frameBytes;
+        size_t audioBytes;
+        Metrics::Clock::time_point epoch;
+        Store store;
+
+        std::mutex slotMutex;
+        std::condition_variable slotFilled;
+        std::vector<Slot> slots;
+        std::vector<int> free;
+        std::vector<int> filled;
+        bool stopping = false;
+
+        std::unique_ptr<AudioTrack> audio;
+        Video::Demand::Consumer raw;
+
+        Metrics::Counter frames{"replay.frames"};
+        Metrics::Counter dropped{"replay.dropped"};
+        Metrics::Counter rawBytes{"replay.bytes_in"};
+        Metrics::Counter storedBytes{"replay.bytes_stored"};
+        Metrics::Timer encodeTime{"replay.encode"};
+        std::thread encoder;
+
+        /// `memory` covers everything: the arena gets what the slots and the
+        /// audio track don't need. resize() can take it up to `maxMemory`
+        /// later. `frameBytes` is the largest frame that will be kept;
+        /// anything bigger is dropped.
+        Buffer(Video::Demand &demand, double seconds, size_t memory, size_t frameBytes, size_t audioBytes = 0, size_t maxMemory = 0, int slotCount = 3):
+            seconds(seconds),
+            frameBytes(frameBytes),
+            audioBytes(audioBytes),
+            epoch(Metrics::Clock::now()),
+            store(arenaBytes(memory, frameBytes, audioBytes, slotCount), (size_t)(seconds * 240) + 16, (uint64_t)(seconds * 1e9), arenaBytes(std::max(memory, maxMemory), frameBytes, audioBytes, slotCount)),
+            slots(slotCount),
+            raw(demand, Video::Stage::Raw, true) {
+            free.reserve(slotCount);
+            filled.reserve(slotCount);
+            for (int i = 0; i < slotCount; i += 1) {
+                slots[i].data.resize(frameBytes);
+                free.push_back(i);
+            }
+            encoder = std::thread([this](){ run(); });
+        }
+
+        ~Buffer() {
+            {
+                std::lock_guard<std::mutex> lock(slotMutex);
+                stopping = true;
+            }
+            slotFilled.notify_one();
+            encoder.join();
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Buffer(Buffer const&) = delete;
+        Buffer& operator=(Buffer const&) = delete;
+
+        /// What the codec can be counted on for with live camera video. Flat
+        /// or static pictures do much better, sensor noise holds it near 2x.
+        static constexpr double expectedRatio = 2.0;
+
+        /// A budget that should hold `seconds` of raw video coming in at
+        /// `bytesPerSecond`, for the same arguments as the constructor.
+        static size_t memoryFor(double seconds, double bytesPerSecond, size_t frameBytes, size_t audioBytes = 0, int slotCount = 3) {
+            return (size_t)(seconds * bytesPerSecond / expectedRatio) + frameBytes * slotCount + audioBytes;
+        }
+
+        static size_t arenaBytes(size_t memory, size_t frameBytes, size_t audioBytes, int slotCount) {
+            size_t fixed = frameBytes * slotCount + audioBytes;
+            if (memory <= fixed + frameBytes) {
+                throw std::runtime_error("Replay memory budget is too small for even one frame.");
+            }
+            return memory - fixed;
+        }
+
+        /// Moves the budget, as in the constructor. Frames that no longer fit
+        /// are dropped once the next one comes in.
+        void resize(size_t memory) {
+            // Never down to where the constructor would have refused.
+            memory = std::max(memory, frameBytes * (slots.size() + 2) + audioBytes);
+            store.resize(arenaBytes(memory, frameBytes, audioBytes, slots.size()));
+        }
+
+        /// Starts keeping audio too; budget for it with AudioTrack::memoryFor()
+        /// up front. The track has to go before the ring.
+        void addAudio(::Audio::Ring &ring, SoundIoFormat format, int sampleRate, int channels) {
+            audio.reset(new AudioTrack(ring, format, sampleRate, channels, seconds, epoch));
+        }
+
+        uint64_t now() {
+            return Metrics::nanosecondsSince(epoch);
+        }
+
+        /// Called on the capture thread only. Copies the frame into a free
+        /// slot, or drops it if the encoder has fallen behind.
+        void capture(uvc_frame_t *frame) {
+            auto header = Record::describe(frame, now());
+            if (header.rawBytes > frameBytes) {
+                dropped.add();
+                return;
+            }
+            int slot;
+            {
+                std::lock_guard<std::mutex> lock(slotMutex);
+                if (free.empty()) {
+                    dropped.add();
+                    Trace::instant("replay.dropped");
+                    return;
+                }
+                slot = free.back();
+                free.pop_back();
+            }
+            memcpy(slots[slot].data.data(), frame->data, header.rawBytes);
+            slots[slot].header = header;
+            {
+                std::lock_guard<std::mutex> lock(slotMutex);
+                filled.push_back(slot);
+            }
+            slotFilled.notify_one();
+        }
+
+        /// Memory, span and cost, in one line.
+        std::string status() {
+            auto range = store.range();
+            size_t used, arena;
+            {
+                std::lock_guard<std::mutex> lock(store.mutex);
+                used = store.usedBytes;
+                arena = store.limit;
+            }
+            auto held = range.second - range.first;
+            double span = held > 1 ? (store.timestamp(range.second - 1) - store.timestamp(range.first)) / 1e9 : 0.0;
+            double interval = held > 1 ? span * 1e3 / (held - 1) : 0.0;
+            auto in = rawBytes.value.load(), out = storedBytes.value.load();
+            size_t total = arena + slots.size() * frameBytes + (audio ? audio->memory() : 0);
+
+            char line[256];
+            snprintf(line, sizeof line, "%.1fs of %.0fs in %llu frames, %.1f of %.1f MB used (%.1f MB allocated in all), %.2fx smaller, encode %.2fms (%.0f%% of a frame), %llu dropped",
+                span, seconds, (unsigned long long)held, used / 1e6, arena / 1e6, total / 1e6,
+                out ? (double)in / out : 0.0, encodeTime.averageMs(), interval > 0 ? 100 * encodeTime.averageMs() / interval : 0.0,
+                (unsigned long long)dropped.value.load());
+            return line;
+        }
+
+        /// Writes what's held right now to `path` as a recording, plus the
+        /// matching audio as a WAV next to it. Frames evicted mid-dump are
+        /// skipped. Returns the number of frames written.
+        size_t dump(std::string path, std::string &audioPath) {
+            auto range = store.range();
+            Record::Writer writer(path);
+            Record::FrameHeader header;
+            std::vector<uint8_t> payload;
+            uint64_t from = 0, to = 0;
+            size_t written = 0;
+            for (auto serial = range.first; serial < range.second; serial += 1) {
+                if (!store.copy(serial, header, payload)) {
+                    continue;
+                }
+                from = written ? from : header.timestamp;
+                to = header.timestamp;
+                // Recordings count from their first frame.
+                header.timestamp -= from;
+                writer.write(header, payload.data());
+                written += 1;
+            }
+            if (!writer.finish()) {
+                throw std::runtime_error("Couldn't write " + path + ".");
+            }
+
+            audioPath.clear();
+            if (audio && written) {
+                auto wav = path.substr(0, path.rfind('.')) + ".wav";
+                if (audio->writeWav(wav, from, to)) {
+                    audioPath = wav;
+                }
+            }
+            return written;
+        }
+
+    private:
+        void run() {
+            Trace::nameThread("replay");
+            for (;;) {
+                int slot;
+                {
+                    std::unique_lock<std::mutex> lock(slotMutex);
+                    slotFilled.wait(lock, [this](){ return stopping || !filled.empty(); });
+                    if (filled.empty()) {
+                        return;
+                    }
+                    slot = filled.front();
+                    filled.erase(filled.begin());
+                }
+
+                auto &header = slots[slot].header;
+                auto at = store.reserve(sizeof header + Record::maxPayload(header));
+                if (at) {
+                    Trace::Span span("replay.encode");
+                    {
+                        Metrics::Scope scope(encodeTime);
+                        Record::encode(header, slots[slot].data.data(), at + sizeof header);
+                    }
+                    memcpy(at, &header, sizeof header);
+                    store.commit(sizeof header + header.payloadBytes, header.timestamp);
+                    frames.add();
+                    rawBytes.add(header.rawBytes);
+                    storedBytes.add(sizeof header + header.payloadBytes);
+                } else {
+                    dropped.add();
+                }
+
+                std::lock_guard<std::mutex> lock(slotMutex);
+                free.push_back(slot);
+            }
+        }
+    };
+
+    /// Plays part of the buffer back in place of the live picture, in real
+    /// time, while capture carries on filling the buffer behind it.
+    ///
+    /// Decoding happens a couple of frames ahead on its own thread. If it
+    /// can't keep up it skips to whatever is due rather than drifting behind.
+    /// Ends at the frame that was newest when playback started.
+    struct Viewer {
+        Buffer &buffer;
+        uint64_t mediaStart;
+        uint64_t endSerial;
+        Metrics::Clock::time_point wallStart;
+
+        std::mutex mutex;
+        std::condition_variable slotFreed;
+        std::vector<std::unique_ptr<Video::Frame>> frames;
+        std::vector<uint64_t> timestamps;
+        std::vector<int> free;
+        std::vector<int> ready;
+        int shown = -1;
+        bool decoded = false;
+        std::atomic<bool> stopping{false};
+        std::thread thread;
+
+        Viewer(Buffer &buffer, double secondsBack, int slotCount = 3):
+            buffer(buffer),
+            timestamps(slotCount) {
+            auto range = buffer.store.range();
+            endSerial = range.second;
+            auto now = buffer.now();
+            auto from = secondsBack > 0 && now > secondsBack * 1e9 ? now - (uint64_t)(secondsBack * 1e9) : 0;
+            mediaStart = std::max(from, buffer.store.timestamp(range.first));
+            wallStart = Metrics::Clock::now();
+            for (int i = 0; i < slotCount; i += 1) {
+                frames.emplace_back(new Video::Frame(buffer.frameBytes));
+            }
+            free.reserve(slotCount);
+            ready.reserve(slotCount);
+            for (int i = 0; i < slotCount; i += 1) {
+                free.push_back(i);
+            }
+            thread = std::thread([this](){ run(); });
+        }
+
+        ~Viewer() {
+            {
+                // Under the lock, or the thread could check it just before
+                // this and miss the wakeup.
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            slotFreed.notify_one();
+            thread.join();
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Viewer(Viewer const&) = delete;
+        Viewer& operator=(Viewer const&) = delete;
+
+        uint64_t mediaNow() {
+            return mediaStart + Metrics::nanosecondsSince(wallStart);
+        }
+
+        /// The frame to show right now, or NULL if there's nothing yet. Call
+        /// on the capture thread once per live frame.
+        Video::Frame* current() {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto now = mediaNow();
+            while (!ready.empty() && timestamps[ready.front()] <= now) {
+                if (shown >= 0) {
+                    free.push_back(shown);
+                }
+                shown = ready.front();
+                ready.erase(ready.begin());
+                slotFreed.notify_one();
+            }
+            return shown >= 0 ? frames[shown].get() : NULL;
+        }
+
+        /// Played through to where it started from.
+        bool finished() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return decoded && ready.empty();
+        }
+
+    private:
+        void run() {
+            Trace::nameThread("replay.view");
+            std::vector<uint8_t> payload(buffer.frameBytes);
+            Record::FrameHeader header;
+            auto serial = buffer.store.find(mediaStart);
+            while (!stopping && serial < endSerial) {
+                int slot;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    slotFreed.wait(lock, [this](){ return stopping || !free.empty(); });
+                    if (stopping) {
+                        return;
+                    }
+                    slot = free.back();
+                    free.pop_back();
+                }
+
+                // Skip ahead to what's due if decoding fell behind, or if
+                // capture evicted the frames we were heading for.
+                auto due = buffer.store.find(mediaNow());
+                serial = std::max(serial, due ? due - 1 : 0);
+                serial = std::max(serial, buffer.store.range().first);
+                bool ok = serial < endSerial && buffer.store.copy(serial, header, payload) && Record::decode(header, payload.data(), *frames[slot]);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (ok) {
+                    timestamps[slot] = header.timestamp;
+                    ready.push_back(slot);
+                } else {
+                    free.push_back(slot);
+                }
+                serial += 1;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            decoded = true;
+        }
+    };
+}
+
+#endif // _replay_hpp
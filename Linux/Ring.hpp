@@ -0,0 +1,268 @@
+#ifndef _ring_hpp
+#define _ring_hpp
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring> // memcpy, memmove, memset
+#include <stdexcept>
+
+namespace Audio {
+    /// A lock-free ring of audio frames with one producer and up to
+    /// `maxReaders` independent readers.
+    ///
+    /// Everything is counted in frames, never bytes: the frame size is fixed
+    /// at construction. Positions are 64-bit and only ever grow, so full and
+    /// empty never need disambiguating. The producer's position, and each
+    /// reader's, live on separate cache lines so the two sides never write to
+    /// the same line.
+    ///
+    /// Readers come in two kinds. Blocking readers (playback) hold the
+    /// producer back: it never overwrites what they haven't read. Lossy
+    /// readers (meters, recorders that can tolerate gaps) don't; if they fall
+    /// more than a ring behind they skip ahead, and reads the producer lapped
+    /// mid-copy are detected and discarded.
+    struct Ring {
+        static const int maxReaders = 8;
+        static const size_t cacheLine = 64;
+
+        struct Span {
+            char *data;
+            size_t frames;
+        };
+
+        struct Spans {
+            Span first;
+            Span second;
+
+            size_t frames() {
+                return first.frames + second.frames;
+            }
+        };
+
+    private:
+        struct alignas(cacheLine) Cursor {
+            std::atomic<uint64_t> position{0};
+            std::atomic<bool> active{false};
+            bool blocking = true;
+            // Reader-local copy of the producer's position, so reads that
+            // fit in what was seen last time don't touch the producer's line.
+            uint64_t cachedWrite = 0;
+            uint64_t overruns = 0;
+        };
+
+        size_t bytesPerFrame;
+        size_t capacity;
+        size_t mask;
+        std::vector<char> storage;
+
+        alignas(cacheLine) std::atomic<uint64_t> writePosition{0};
+        // Published before the producer touches storage, so lossy readers can
+        // tell whether what they just copied was being overwritten.
+        std::atomic<uint64_t> reservedPosition{0};
+
+        alignas(cacheLine) uint64_t cachedMinRead = 0;
+
+        Cursor cursors[maxReaders];
+
+    public:
+        /// `frames` is rounded up to a power of two.
+        Ring(size_t frames, size_t bytesPerFrame): bytesPerFrame(bytesPerFrame) {
+            if (!frames || !bytesPerFrame) {
+                throw std::runtime_error("Ring buffer needs a non-zero size.");
+            }
+            capacity = 1;
+            while (capacity < frames) {
+                capacity <<= 1;
+            }
+            mask = capacity - 1;
+            storage.resize(capacity * bytesPerFrame + cacheLine);
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Ring(Ring const&) = delete;
+        Ring& operator=(Ring const&) = delete;
+
+        size_t frameCapacity() {
+            return capacity;
+        }
+
+        size_t frameBytes() {
+            return bytesPerFrame;
+        }
+
+        /// Registers a reader starting at the producer's current position.
+        /// Call before or while streaming; the producer picks it up on its
+        /// next write.
+        int addReader(bool blocking = true) {
+            for (int i = 0; i < maxReaders; i += 1) {
+                auto &cursor = cursors[i];
+                if (cursor.active.load(std::memory_order_relaxed)) {
+                    continue;
+                }
+                auto position = writePosition.load(std::memory_order_acquire);
+                cursor.blocking = blocking;
+                cursor.cachedWrite = position;
+                cursor.overruns = 0;
+                cursor.position.store(position, std::memory_order_relaxed);
+                cursor.active.store(true, std::memory_order_release);
+                return i;
+            }
+            throw std::runtime_error("Too many ring buffer readers.");
+        }
+
+        void removeReader(int reader) {
+            cursors[reader].active.store(false, std::memory_order_release);
+        }
+
+        /// Times a lossy reader fell behind and had to skip ahead.
+        uint64_t overruns(int reader) {
+            return cursors[reader].overruns;
+        }
+
+        /// How far a reader has got: frames read plus any it skipped. Call
+        /// from the reader's thread.
+        uint64_t readPosition(int reader) {
+            return cursors[reader].position.load(std::memory_order_relaxed);
+        }
+
+        // Producer side
+
+        /// Frames the producer can write without overtaking a blocking reader.
+        size_t writable() {
+            auto write = writePosition.load(std::memory_order_relaxed);
+            if (capacity - (write - cachedMinRead) >= capacity / 2) {
+                return capacity - (write - cachedMinRead);
+            }
+            refreshMinRead(write);
+            return capacity - (write - cachedMinRead);
+        }
+
+        /// Up to `frames` of contiguous space to write into, in at most two
+        /// pieces when it wraps. Follow with commitWrite().
+        Spans writeSpans(size_t frames) {
+            frames = std::min(frames, writable());
+            auto write = writePosition.load(std::memory_order_relaxed);
+            reservedPosition.store(write + frames, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            return spansAt(write, frames);
+        }
+
+        void commitWrite(size_t frames) {
+            auto write = writePosition.load(std::memory_order_relaxed);
+            writePosition.store(write + frames, std::memory_order_release);
+        }
+
+        /// Copies interleaved frames in. Returns how many fit.
+        size_t write(const void *source, size_t frames) {
+            auto spans = writeSpans(frames);
+            memcpy(spans.first.data, source, spans.first.frames * bytesPerFrame);
+            memcpy(spans.second.data, (const char*)source + spans.first.frames * bytesPerFrame, spans.second.frames * bytesPerFrame);
+            commitWrite(spans.frames());
+            return spans.frames();
+        }
+
+        /// Writes zeroed frames, e.g. to pre-fill the ring with latency.
+        size_t writeSilence(size_t frames) {
+            auto spans = writeSpans(frames);
+            memset(spans.first.data, 0, spans.first.frames * bytesPerFrame);
+            memset(spans.second.data, 0, spans.second.frames * bytesPerFrame);
+            commitWrite(spans.frames());
+            return spans.frames();
+        }
+
+        // Reader side
+
+        size_t readable(int reader) {
+            auto &cursor = cursors[reader];
+            auto position = cursor.position.load(std::memory_order_relaxed);
+            cursor.cachedWrite = writePosition.load(std::memory_order_acquire);
+            if (!cursor.blocking && cursor.cachedWrite - position > capacity) {
+                // Lapped: everything before write - capacity is gone.
+                cursor.overruns += 1;
+                position = cursor.cachedWrite - capacity;
+                cursor.position.store(position, std::memory_order_relaxed);
+            }
+            return cursor.cachedWrite - position;
+        }
+
+        /// Up to `frames` of readable data, in at most two pieces. Follow with
+        /// commitRead(). Lossy readers should use read() instead, which
+        /// validates the copy.
+        Spans readSpans(int reader, size_t frames) {
+            auto &cursor = cursors[reader];
+            auto position = cursor.position.load(std::memory_order_relaxed);
+            if (cursor.cachedWrite - position < frames) {
+                frames = std::min(frames, readable(reader));
+                position = cursor.position.load(std::memory_order_relaxed);
+            }
+            return spansAt(position, frames);
+        }
+
+        void commitRead(int reader, size_t frames) {
+            auto &cursor = cursors[reader];
+            auto position = cursor.position.load(std::memory_order_relaxed);
+            cursor.position.store(position + frames, std::memory_order_release);
+        }
+
+        /// Copies up to `frames` out and advances. For lossy readers, frames
+        /// the producer overwrote during the copy are dropped from the result.
+        size_t read(int reader, void *destination, size_t frames) {
+            auto &cursor = cursors[reader];
+            auto spans = readSpans(reader, frames);
+            auto position = cursor.position.load(std::memory_order_relaxed);
+            memcpy(destination, spans.first.data, spans.first.frames * bytesPerFrame);
+            memcpy((char*)destination + spans.first.frames * bytesPerFrame, spans.second.data, spans.second.frames * bytesPerFrame);
+            size_t count = spans.frames();
+
+            if (!cursor.blocking) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                auto reserved = reservedPosition.load(std::memory_order_relaxed);
+                if (reserved > position + capacity) {
+                    // The first (reserved - capacity - position) frames may be torn.
+                    auto torn = std::min<uint64_t>(reserved - capacity - position, count);
+                    cursor.overruns += 1;
+                    memmove(destination, (char*)destination + torn * bytesPerFrame, (count - torn) * bytesPerFrame);
+                    commitRead(reader, torn);
+                    count -= torn;
+                }
+            }
+
+            commitRead(reader, count);
+            return count;
+        }
+
+    private:
+        char *base() {
+            // Storage is over-allocated by a cache line so frames start aligned.
+            auto address = (uintptr_t)storage.data();
+            return storage.data() + ((cacheLine - (address & (cacheLine - 1))) & (cacheLine - 1));
+        }
+
+        Spans spansAt(uint64_t position, size_t frames) {
+            size_t offset = position & mask;
+            size_t first = std::min(frames, capacity - offset);
+            return {
+                {base() + offset * bytesPerFrame, first},
+                {base(), frames - first}
+            };
+        }
+
+        void refreshMinRead(uint64_t write) {
+            uint64_t minimum = write;
+            for (auto &cursor: cursors) {
+                if (!cursor.active.load(std::memory_order_acquire) || !cursor.blocking) {
+                    continue;
+                }
+                auto position = cursor.position.load(std::memory_order_acquire);
+                if (position < minimum) {
+                    minimum = position;
+                }
+            }
+            cachedMinRead = minimum;
+        }
+    };
+}
+
+#endif // _ring_hpp
@@ -0,0 +1,337 @@
+#ifndef _scopes_hpp
+#define _scopes_hpp
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstring> // memset, memcpy
+#include <algorithm>
+#include <memory>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "Async.hpp"
+#include "Frame.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+#include "Overlay.hpp"
+
+namespace Scopes {
+    static const int levels = 256;
+    static const int waveformColumns = 256;
+    static const int vectorscopeSize = 128;
+
+    static const int panelHeight = 128;
+    static const int histogramWidth = levels;
+    static const int waveformWidth = waveformColumns;
+    static const int panelWidth = histogramWidth + waveformWidth + vectorscopeSize;
+
+    /// Adds `count` counters of src into dst, four at a time with SSE2.
+    /// `count` is a multiple of four; every table here is.
+    inline void addCounts(uint32_t *dst, const uint32_t *src, size_t count) {
+#ifdef __SSE2__
+        for (size_t i = 0; i < count; i += 4) {
+            __m128i sum = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(dst + i)), _mm_loadu_si128((const __m128i*)(src + i)));
+            _mm_storeu_si128((__m128i*)(dst + i), sum);
+        }
+#else
+        for (size_t i = 0; i < count; i += 1) {
+            dst[i] += src[i];
+        }
+#endif
+    }
+
+    /// Luma histogram, luma waveform and U/V vectorscope counts, read
+    /// straight off packed YUYV.
+    ///
+    /// The rows are split into one horizontal stripe per thread, each
+    /// counting into its own tables, and the stripes are added together
+    /// with SSE2 at the end. Within a stripe histogram increments are
+    /// spread over four interleaved tables so consecutive samples with the
+    /// same value don't serialize on one counter. Stripe 0 counts straight
+    /// into `waveform` and `vectorscope`, so one thread costs no merge.
+    struct Accumulator {
+        struct Stripe {
+            alignas(16) uint32_t partial[4][levels];
+            std::vector<uint32_t> waveform;
+            std::vector<uint32_t> vectorscope;
+        };
+
+        alignas(16) uint32_t histogram[levels];
+        std::vector<uint32_t> waveform; // [column][level]
+        std::vector<uint32_t> vectorscope; // [v][u], halved resolution
+        std::vector<uint16_t> columnOf; // pixel pair -> waveform column
+        int rowStride;
+        std::vector<Stripe> stripes;
+        std::unique_ptr<Async::Pool> pool;
+
+        Accumulator(int rowStride = 2, size_t threads = 1):
+            waveform(waveformColumns * levels),
+            vectorscope(vectorscopeSize * vectorscopeSize),
+            rowStride(rowStride),
+            stripes(std::max<size_t>(threads, 1)),
+            pool(threads > 1 ? new Async::Pool(threads - 1) : NULL) {
+            for (size_t i = 1; i < stripes.size(); i += 1) {
+                stripes[i].waveform.resize(waveform.size());
+                stripes[i].vectorscope.resize(vectorscope.size());
+            }
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Accumulator(Accumulator const&) = delete;
+        Accumulator& operator=(Accumulator const&) = delete;
+
+        void accumulate(const uint8_t *data, size_t step, int width, int height) {
+            int pairs = width / 2;
+            if ((int)columnOf.size() != pairs) {
+                columnOf.resize(pairs);
+                for (int p = 0; p < pairs; p += 1) {
+                    columnOf[p] = (uint32_t)p * waveformColumns / pairs;
+                }
+            }
+
+            int rows = (height + rowStride - 1) / rowStride;
+            size_t parts = std::min<size_t>(stripes.size(), std::max(1, rows / 16));
+            auto work = [&](size_t part) {
+                int y0 = rows * part / parts * rowStride, y1 = rows * (part + 1) / parts * rowStride;
+                count(stripes[part], part ? stripes[part].waveform.data() : waveform.data(), part ? stripes[part].vectorscope.data() : vectorscope.data(), data, step, pairs, y0, std::min(y1, height));
+            };
+            if (parts > 1) {
+                pool->parallel(parts, work);
+            } else {
+                work(0);
+            }
+
+            memset(histogram, 0, sizeof histogram);
+            for (size_t part = 0; part < parts; part += 1) {
+                for (int i = 0; i < 4; i += 1) {
+                    addCounts(histogram, stripes[part].partial[i], levels);
+                }
+                if (part) {
+                    addCounts(waveform.data(), stripes[part].waveform.data(), waveform.size());
+                    addCounts(vectorscope.data(), stripes[part].vectorscope.data(), vectorscope.size());
+                }
+            }
+        }
+
+    private:
+        void count(Stripe &stripe, uint32_t *wave, uint32_t *vector, const uint8_t *data, size_t step, int pairs, int y0, int y1) {
+            auto &partial = stripe.partial;
+            memset(partial, 0, sizeof partial);
+            std::fill(wave, wave + waveformColumns * levels, 0);
+            std::fill(vector, vector + vectorscopeSize * vectorscopeSize, 0);
+
+            for (int y = y0; y < y1; y += rowStride) {
+                auto row = data + y * step;
+                int p = 0;
+                for (; p + 2 <= pairs; p += 2) {
+                    auto px = row + p * 4;
+                    partial[0][px[0]] += 1;
+                    partial[1][px[2]] += 1;
+                    partial[2][px[4]] += 1;
+                    partial[3][px[6]] += 1;
+                    auto columnA = wave + columnOf[p] * levels;
+                    auto columnB = wave + columnOf[p + 1] * levels;
+                    columnA[px[0]] += 1;
+                    columnA[px[2]] += 1;
+                    columnB[px[4]] += 1;
+                    columnB[px[6]] += 1;
+                    vector[(px[3] >> 1) * vectorscopeSize + (px[1] >> 1)] += 1;
+                    vector[(px[7] >> 1) * vectorscopeSize + (px[5] >> 1)] += 1;
+                }
+                for (; p < pairs; p += 1) {
+                    auto px = row + p * 4;
+                    partial[0][px[0]] += 1;
+                    partial[1][px[2]] += 1;
+                    auto column = wave + columnOf[p] * levels;
+                    column[px[0]] += 1;
+                    column[px[2]] += 1;
+                    vector[(px[3] >> 1) * vectorscopeSize + (px[1] >> 1)] += 1;
+                }
+            }
+        }
+    };
+
+    inline uint8_t intensity(uint32_t count, uint32_t scale) {
+        // scale is the count that maps to full brightness
+        return count >= scale ? 255 : (count * 255) / scale;
+    }
+
+    /// Renders an Accumulator into a panelWidth x panelHeight BGR image:
+    /// histogram, waveform and vectorscope, left to right.
+    inline void render(Accumulator &scopes, uint8_t *panel, int samplesPerColumn) {
+        const size_t step = panelWidth * 3;
+        memset(panel, 0, step * panelHeight);
+
+        // Histogram: bars scaled to the tallest bin, ignoring the clip bins so
+        // a blown-out sky doesn't flatten everything else.
+        uint32_t tallest = 1;
+        for (int i = 1; i < levels - 1; i += 1) {
+            tallest = std::max(tallest, scopes.histogram[i]);
+        }
+        for (int x = 0; x < histogramWidth; x += 1) {
+            int bar = std::min<uint32_t>(panelHeight, (uint64_t)scopes.histogram[x] * panelHeight / tallest);
+            bool clipped = (x == 0 || x == levels - 1) && scopes.histogram[x];
+            for (int y = panelHeight - bar; y < panelHeight; y += 1) {
+                auto out = panel + y * step + x * 3;
+                out[0] = clipped ? 0 : 220;
+                out[1] = clipped ? 0 : 220;
+                out[2] = 220;
+            }
+        }
+
+        // Waveform: two levels per row, brightness from sample density.
+        uint32_t waveScale = std::max(1, samplesPerColumn / 24);
+        for (int x = 0; x < waveformColumns; x += 1) {
+            auto column = &scopes.waveform[x * levels];
+            for (int y = 0; y < panelHeight; y += 1) {
+                int level = levels - 2 - y * 2;
+                auto out = panel + y * step + (histogramWidth + x) * 3;
+                out[1] = intensity(column[level] + column[level + 1], waveScale);
+            }
+        }
+
+        // Vectorscope: U across, V up, with a crosshair at neutral.
+        uint32_t vectorScale = std::max(1, samplesPerColumn * waveformColumns / 2 / 2048);
+        for (int y = 0; y < vectorscopeSize; y += 1) {
+            int v = vectorscopeSize - 1 - y;
+            for (int u = 0; u < vectorscopeSize; u += 1) {
+                auto out = panel + y * step + (histogramWidth + waveformWidth + u) * 3;
+                auto value = intensity(scopes.vectorscope[v * vectorscopeSize + u], vectorScale);
+                bool axis = u == vectorscopeSize / 2 || v == vectorscopeSize / 2;
+                out[0] = std::max<uint8_t>(value, axis ? 80 : 0);
+                out[1] = std::max<uint8_t>(value, axis ? 80 : 0);
+                out[2] = std::max<uint8_t>(value, axis ? 80 : 0);
+            }
+        }
+    }
+
+    /// Averages src into dst (a 50% blend), 16 bytes at a time with SSE2.
+    inline void blend(uint8_t *dst, const uint8_t *src, size_t bytes) {
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 16 <= bytes; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_avg_epu8(a, b));
+        }
+#endif
+        for (; i < bytes; i += 1) {
+            dst[i] = (dst[i] + src[i] + 1) >> 1;
+        }
+    }
+
+    /// Computes the scopes on a worker thread from every `interval`-th frame
+    /// and composites the latest result into the bottom left of the preview.
+    /// The worker spreads each frame over `threads` stripes, itself included.
+    ///
+    /// The capture thread only copies a frame into the pool, and only if the
+    /// worker is idle; if it's still busy the update is skipped, so a slow
+    /// machine gets a slower scope rather than a slower stream.
+    struct Overlay: Video::Overlay {
+        int interval;
+        std::atomic<bool> enabled;
+
+        Video::FramePool pool;
+        Accumulator accumulator;
+        // Triple buffered: the worker renders into back, publishes it as
+        // ready, and the capture thread picks ready up into panel.
+        std::vector<uint8_t> back;
+        std::mutex mutex;
+        std::vector<uint8_t> ready; // guarded by mutex
+        bool readyIsNew = false; // guarded by mutex
+        std::vector<uint8_t> panel;
+        std::atomic<bool> fresh{false};
+        uint64_t frames = 0;
+
+        Metrics::Timer copyTime{"scopes.copy"};
+        Metrics::Timer computeTime{"scopes.compute"};
+        Metrics::Timer compositeTime{"scopes.composite"};
+        Metrics::Counter busy{"scopes.skipped_busy"};
+
+        // Declared last so it's joined before anything it touches goes away.
+        Async::Worker worker;
+
+        Overlay(size_t frameCapacity, int interval = 4, bool enabled = true, size_t threads = 2): interval(std::max(1, interval)), enabled(enabled), pool(2, frameCapacity), accumulator(2, threads), back(panelWidth * panelHeight * 3), ready(back.size()), panel(back.size()) {}
+
+        void toggle() {
+            enabled = !enabled;
+            fresh = true;
+        }
+
+        /// Called from the capture thread with every frame.
+        void offer(uvc_frame_t *frame) {
+            if (!enabled || frame->frame_format != UVC_FRAME_FORMAT_YUYV) {
+                return;
+            }
+            if (frames++ % interval) {
+                return;
+            }
+            if (worker.pending()) {
+                busy.add();
+                return;
+            }
+
+            Video::FrameRef pooled;
+            {
+                Metrics::Scope scope(copyTime);
+                pooled = pool.acquire();
+                if (!pooled || !pooled->copyFrom(frame)) {
+                    busy.add();
+                    return;
+                }
+            }
+            worker.post([this, pooled]() {
+                compute(*pooled);
+            });
+        }
+
+        bool visible() override {
+            return enabled;
+        }
+
+        bool changed() override {
+            return fresh.exchange(false);
+        }
+
+        Rect rect(int width, int height) override {
+            return {0, height - panelHeight, panelWidth, panelHeight};
+        }
+
+        void draw(uint8_t *bgr, size_t step, Rect rect) override {
+            Metrics::Scope scope(compositeTime);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (readyIsNew) {
+                    panel.swap(ready);
+                    readyIsNew = false;
+                }
+            }
+            for (int y = 0; y < rect.height; y += 1) {
+                blend(bgr + (rect.y + y) * step + rect.x * 3, &panel[y * panelWidth * 3], rect.width * 3);
+            }
+        }
+
+    private:
+        void compute(Video::Frame &frame) {
+            Metrics::Scope scope(computeTime);
+            Trace::nameThread("scopes");
+            Trace::Span span("scopes.compute");
+            accumulator.accumulate(frame.data.data(), frame.step, frame.width, frame.height);
+            int samplesPerColumn = (frame.height / accumulator.rowStride) * frame.width / waveformColumns;
+
+            render(accumulator, back.data(), samplesPerColumn);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                back.swap(ready);
+                readyIsNew = true;
+            }
+            fresh = true;
+        }
+    };
+}
+
+#endif // _scopes_hpp
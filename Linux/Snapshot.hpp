@@ -0,0 +1,94 @@
+#ifndef _snapshot_hpp
+#define _snapshot_hpp
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <atomic>
+#include <string>
+#include <cstdio>
+#include <stdexcept>
+
+#include "Async.hpp"
+#include "Frame.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+namespace Snapshot {
+    /// Encodes stills off of the capture thread.
+    ///
+    /// The capture thread only hands over a reference to a pooled frame;
+    /// colour conversion, compression and the write to disk all happen on
+    /// the writer's own thread.
+    struct Writer {
+        std::string directory;
+        std::string extension;
+        std::atomic<int> counter{0};
+        Metrics::Timer encodeTime{"snapshot.encode"};
+        Metrics::Counter saved{"snapshot.saved"};
+        Metrics::Counter failed{"snapshot.failed"};
+        Async::Worker worker;
+
+        Writer(std::string directory, std::string extension): directory(directory), extension(extension) {
+            if (extension != "png" && extension != "jpg" && extension != "jpeg") {
+                throw std::runtime_error("Unsupported snapshot format '" + extension + "'.");
+            }
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Writer(Writer const&) = delete;
+        Writer& operator=(Writer const&) = delete;
+
+        void capture(Video::FrameRef frame) {
+            auto index = counter.fetch_add(1);
+            worker.post([this, frame, index]() {
+                encode(*frame, index);
+            });
+        }
+
+        size_t pending() {
+            return worker.pending();
+        }
+
+    private:
+        void encode(Video::Frame &frame, int index) {
+            auto start = Metrics::Clock::now();
+            Trace::nameThread("snapshot");
+            Trace::Span span("snapshot.encode", index);
+
+            if (frame.format != UVC_FRAME_FORMAT_YUYV) {
+                fprintf(stderr, "Snapshot %d skipped: unsupported frame format %d.\n", index, frame.format);
+                failed.add();
+                return;
+            }
+
+            cv::Mat yuyv(frame.height, frame.width, CV_8UC2, frame.data.data(), frame.step);
+            cv::Mat bgr;
+            cv::cvtColor(yuyv, bgr, cv::COLOR_YUV2BGR_YUYV);
+
+            char name[64];
+            snprintf(name, sizeof name, "snapshot-%ld-%06u-%03d.", (long)frame.captureTime.tv_sec, frame.sequence, index);
+            auto path = directory + "/" + name + extension;
+
+            bool ok = false;
+            try {
+                ok = cv::imwrite(path, bgr);
+            } catch (cv::Exception &e) {
+                fprintf(stderr, "%s\n", e.what());
+            }
+
+            auto elapsed = Metrics::nanosecondsSince(start);
+            if (!ok) {
+                fprintf(stderr, "Failed to write snapshot to %s.\n", path.c_str());
+                failed.add();
+                return;
+            }
+            encodeTime.record(elapsed);
+            saved.add();
+            fprintf(stderr, "Saved %s (%dx%d, encoded in %.1fms).\n", path.c_str(), frame.width, frame.height, elapsed / 1e6);
+        }
+    };
+}
+
+#endif // _snapshot_hpp
@@ -2,8 +2,10 @@
 #define _soundio_hpp
 
 #include <vector>
+#include <string>
 #include <thread>
-#include <cstring> // memset
+#include <optional>
+#include <cstring> // memset, memcpy
 #include <stdexcept>
 
 #include <soundio/soundio.h>
@@ -11,12 +13,46 @@
 namespace SoundIO {
     typedef SoundIoChannelLayout Layout;
     typedef SoundIoFormat Format;
-    typedef SoundIoRingBuffer GlobalRingBuffer;
 
     typedef void (*ReadCallback)(struct SoundIoInStream *, int frame_count_min, int frame_count_max);
     typedef void (*WriteCallback)(struct SoundIoOutStream *, int frame_count_min, int frame_count_max);
     typedef void (*UnderflowCallback)(struct SoundIoOutStream *);
 
+    /// Interleaves frameCount frames from libsoundio's channel areas into
+    /// dest, advancing the areas. Returns the end of what was written.
+    inline char* readAreas(SoundIoChannelArea *areas, int channelCount, int bytesPerSample, int frameCount, char *dest) {
+        for (int frame = 0; frame < frameCount; frame += 1) {
+            for (int ch = 0; ch < channelCount; ch += 1) {
+                memcpy(dest, areas[ch].ptr, bytesPerSample);
+                areas[ch].ptr += areas[ch].step;
+                dest += bytesPerSample;
+            }
+        }
+        return dest;
+    }
+
+    /// The inverse of readAreas: spreads interleaved frames from source into
+    /// the channel areas. Returns the end of what was read.
+    inline const char* writeAreas(SoundIoChannelArea *areas, int channelCount, int bytesPerSample, int frameCount, const char *source) {
+        for (int frame = 0; frame < frameCount; frame += 1) {
+            for (int ch = 0; ch < channelCount; ch += 1) {
+                memcpy(areas[ch].ptr, source, bytesPerSample);
+                areas[ch].ptr += areas[ch].step;
+                source += bytesPerSample;
+            }
+        }
+        return source;
+    }
+
+    inline void silenceAreas(SoundIoChannelArea *areas, int channelCount, int bytesPerSample, int frameCount) {
+        for (int frame = 0; frame < frameCount; frame += 1) {
+            for (int ch = 0; ch < channelCount; ch += 1) {
+                memset(areas[ch].ptr, 0, bytesPerSample);
+                areas[ch].ptr += areas[ch].step;
+            }
+        }
+    }
+
     struct InStream {
         SoundIoInStream *internal = NULL;
 
@@ -51,6 +87,21 @@ namespace SoundIO {
             return internal->bytes_per_frame;
         }
 
+        /// What the backend actually gave us, which may differ from what was asked for.
+        double getSoftwareLatency() {
+            return internal->software_latency;
+        }
+
+        /// Current latency of the stream as reported by the backend, or nullopt
+        /// if it can't tell. Only meaningful once started.
+        std::optional<double> getLatency() {
+            double latency;
+            if (soundio_instream_get_latency(internal, &latency)) {
+                return std::nullopt;
+            }
+            return latency;
+        }
+
         void start() {
             auto error = soundio_instream_start(internal);
             if (error) {
@@ -94,6 +145,21 @@ namespace SoundIO {
             return internal->bytes_per_frame;
         }
 
+        /// What the backend actually gave us, which may differ from what was asked for.
+        double getSoftwareLatency() {
+            return internal->software_latency;
+        }
+
+        /// Current latency of the stream as reported by the backend, or nullopt
+        /// if it can't tell. Only meaningful once started.
+        std::optional<double> getLatency() {
+            double latency;
+            if (soundio_outstream_get_latency(internal, &latency)) {
+                return std::nullopt;
+            }
+            return latency;
+        }
+
         void start() {
             auto error = soundio_outstream_start(internal);
             if (error) {
@@ -127,6 +193,14 @@ namespace SoundIO {
             return std::string(internal->name);
         }
 
+        double getMinimumLatency() {
+            return internal->software_latency_min;
+        }
+
+        double getMaximumLatency() {
+            return internal->software_latency_max;
+        }
+
         bool supportsSampleRate(int sampleRate) {
             return soundio_device_supports_sample_rate(internal, sampleRate);
         }
@@ -187,14 +261,24 @@ namespace SoundIO {
         SoundIo *internal = NULL;
         double latency;
 
-        Context() {
+        /// Connects to `backend`, or whichever backend libsoundio prefers.
+        Context(std::optional<SoundIoBackend> backend = std::nullopt) {
             internal = soundio_create();
             if (internal == NULL) {
                 throw std::runtime_error("Failed to create SoundIO context.");
             }
-            auto err = soundio_connect(internal);
-            if (err) {
-                throw std::runtime_error("Failed to connect to SoundIO backend.");
+            if (backend.has_value()) {
+                auto err = soundio_connect_backend(internal, backend.value());
+                if (err) {
+                    soundio_destroy(internal);
+                    throw std::runtime_error("Failed to connect to the " + backendName(backend.value()) + " backend: " + soundio_strerror(err));
+                }
+            } else {
+                auto err = soundio_connect(internal);
+                if (err) {
+                    soundio_destroy(internal);
+                    throw std::runtime_error("Failed to connect to SoundIO backend.");
+                }
             }
 
             soundio_flush_events(internal);
@@ -251,24 +335,6 @@ namespace SoundIO {
             return Device(soundio_get_output_device(internal, index));
         }
 
-        void prepareGlobalBuffer(GlobalRingBuffer* &buffer, InStream &in, OutStream& out, double latency) {
-            int capacity = 2 * latency * in.getSampleRate() * in.getBytesPerFrame();
-
-            buffer = soundio_ring_buffer_create(internal, capacity);
-
-            if (!buffer) {
-                throw std::runtime_error("Failed to create buffer.");
-            }
-
-            int fill_count = latency * out.getSampleRate() * out.getBytesPerFrame();
-
-            auto buf = soundio_ring_buffer_write_ptr(buffer);
-            
-            memset(buf, 0, fill_count);
-
-            soundio_ring_buffer_advance_write_ptr(buffer, fill_count);
-        }
-
         void flushEvents() {
             soundio_flush_events(internal);
         }
@@ -284,6 +350,55 @@ namespace SoundIO {
         static std::string formatName(Format format) {
             return soundio_format_string(format);
         }
+
+        static std::string backendName(SoundIoBackend backend) {
+            return soundio_backend_name(backend);
+        }
+
+        /// The names --audio_backend accepts, and the backend each picks.
+        static const std::vector<std::pair<std::string, SoundIoBackend>> &backendNames() {
+            static const std::vector<std::pair<std::string, SoundIoBackend>> names = {
+                {"jack", SoundIoBackendJack},
+                {"pulseaudio", SoundIoBackendPulseAudio},
+                {"alsa", SoundIoBackendAlsa},
+                {"coreaudio", SoundIoBackendCoreAudio},
+                {"wasapi", SoundIoBackendWasapi},
+                {"dummy", SoundIoBackendDummy},
+            };
+            return names;
+        }
+
+        /// backendNames() joined for help text, as in "jack, alsa or dummy".
+        static std::string backendChoices() {
+            auto &names = backendNames();
+            std::string choices;
+            for (size_t i = 0; i < names.size(); i += 1) {
+                choices += (i == 0 ? "" : i + 1 == names.size() ? " or " : ", ") + names[i].first;
+            }
+            return choices;
+        }
+
+        static std::optional<SoundIoBackend> backendByName(std::string name) {
+            for (auto &entry: backendNames()) {
+                if (name == entry.first) {
+                    return entry.second;
+                }
+            }
+            return std::nullopt;
+        }
+
+        /// Backends compiled into this libsoundio, in its order of preference.
+        std::vector<SoundIoBackend> availableBackends() {
+            std::vector<SoundIoBackend> backends;
+            for (int i = 0; i < soundio_backend_count(internal); i += 1) {
+                backends.push_back(soundio_get_backend(internal, i));
+            }
+            return backends;
+        }
+
+        SoundIoBackend currentBackend() {
+            return internal->current_backend;
+        }
     };
 }
 
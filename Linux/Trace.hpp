@@ -0,0 +1,316 @@
+#ifndef _trace_hpp
+#define _trace_hpp
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+
+#include "Metrics.hpp"
+
+/// A timeline of what each thread was doing, for when the aggregate numbers
+/// in Metrics say a frame was late but not why.
+///
+/// Every thread appends to its own fixed size buffer, taken from a set
+/// allocated when tracing starts, so recording is a clock read and a few
+/// stores with no locks or allocation. Buffers wrap around and
+/// keep the most recent events, which makes it usable as a flight recorder:
+/// leave it on and dump it after something goes wrong. Dumps are Chrome trace
+/// JSON, which chrome://tracing and ui.perfetto.dev both open.
+namespace Trace {
+    enum class Phase: char {
+        Complete = 'X',
+        Instant = 'i',
+        Counter = 'C'
+    };
+
+    struct Event {
+        const char *name;
+        uint64_t begin;
+        uint64_t duration;
+        int64_t value;
+        Phase phase;
+    };
+
+    inline std::atomic<bool>& enabled() {
+        static std::atomic<bool> on{false};
+        return on;
+    }
+
+    inline Metrics::Clock::time_point epoch() {
+        static auto start = Metrics::Clock::now();
+        return start;
+    }
+
+    inline uint64_t now() {
+        return Metrics::nanosecondsSince(epoch());
+    }
+
+    /// Single producer event buffer owned by one thread at a time. The
+    /// dumping thread reads it concurrently and throws away anything that
+    /// may have been overwritten while it was copying, like Audio::Ring's
+    /// lossy readers.
+    struct Buffer {
+        static const size_t capacity = 1 << 15;
+
+        std::atomic<bool> claimed{false};
+        std::atomic<int> tid{0};
+        std::atomic<const char*> name{NULL};
+        std::unique_ptr<Event[]> events;
+        std::atomic<uint64_t> head{0};
+        std::atomic<uint64_t> floor{0};
+
+        Buffer(): events(new Event[capacity]) {}
+
+        ///This is a managed RAII resource. this object is not copyable
+        Buffer(Buffer const&) = delete;
+        Buffer& operator=(Buffer const&) = delete;
+
+        void push(const Event &event) {
+            auto position = head.load(std::memory_order_relaxed);
+            events[position & (capacity - 1)] = event;
+            head.store(position + 1, std::memory_order_release);
+        }
+
+        /// Forgets everything recorded so far without touching the writer.
+        void clear() {
+            floor.store(head.load(std::memory_order_acquire), std::memory_order_relaxed);
+        }
+
+        /// Copies out what's still intact. Returns how many events were lost
+        /// to wrapping.
+        uint64_t collect(std::vector<Event> &out) {
+            auto end = head.load(std::memory_order_acquire);
+            auto start = std::max(floor.load(std::memory_order_relaxed), end > capacity ? end - capacity : 0);
+            auto offset = out.size();
+            for (auto position = start; position < end; position += 1) {
+                out.push_back(events[position & (capacity - 1)]);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // The writer may have lapped the oldest entries while we copied,
+            // and may be halfway through overwriting the next one.
+            auto after = head.load(std::memory_order_relaxed) + 1;
+            uint64_t torn = after > start + capacity ? std::min(after - capacity - start, end - start) : 0;
+            out.erase(out.begin() + offset, out.begin() + offset + torn);
+            return (start - floor.load(std::memory_order_relaxed)) + torn;
+        }
+    };
+
+    /// A fixed set of buffers, all allocated up front so that no traced
+    /// thread (libsoundio's realtime callbacks included) ever allocates or
+    /// takes a lock. Threads claim a free buffer on their first event and
+    /// hand it back when they exit; its events stay in dumps until another
+    /// thread reuses it. Threads beyond the last buffer aren't traced, and
+    /// their events count as lost.
+    struct Recorder {
+        static const size_t maxThreads = 32;
+
+        std::mutex mutex;
+        Buffer buffers[maxThreads];
+        std::atomic<int> nextTid{1};
+        std::atomic<size_t> claims{0};
+        std::atomic<uint64_t> unclaimed{0};
+
+        static Recorder& shared() {
+            static Recorder recorder;
+            return recorder;
+        }
+
+        /// The calling thread's buffer, claimed on first use, or NULL if
+        /// they're all taken.
+        Buffer* local() {
+            struct Claim {
+                Buffer *buffer = NULL;
+
+                ~Claim() {
+                    if (buffer) {
+                        buffer->claimed.store(false, std::memory_order_release);
+                    }
+                }
+            };
+            thread_local Claim claim;
+            if (!claim.buffer) {
+                claim.buffer = this->claim();
+                if (!claim.buffer) {
+                    unclaimed.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            return claim.buffer;
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto &buffer: buffers) {
+                buffer.clear();
+            }
+            unclaimed = 0;
+        }
+
+        /// Writes Chrome trace JSON. Returns the number of events written.
+        /// Only the copy out of the buffers happens under the lock; the
+        /// formatting and file I/O don't hold anything up.
+        size_t write(FILE *stream) {
+            struct Track {
+                int tid;
+                const char *name;
+                size_t first, last;
+            };
+            std::vector<Event> events;
+            std::vector<Track> tracks;
+            uint64_t lost = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto &buffer: buffers) {
+                    auto tid = buffer.tid.load(std::memory_order_acquire);
+                    if (!tid) {
+                        continue;
+                    }
+                    auto first = events.size();
+                    lost += buffer.collect(events);
+                    tracks.push_back({tid, buffer.name.load(std::memory_order_relaxed), first, events.size()});
+                }
+                lost += unclaimed.load(std::memory_order_relaxed);
+            }
+
+            fprintf(stream, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+            fprintf(stream, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"uvc\"}}");
+            for (auto &track: tracks) {
+                if (track.name) {
+                    fprintf(stream, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", track.tid, track.name);
+                } else {
+                    fprintf(stream, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", track.tid, track.tid);
+                }
+                for (auto i = track.first; i < track.last; i += 1) {
+                    auto &event = events[i];
+                    switch (event.phase) {
+                    case Phase::Complete:
+                        fprintf(stream, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"value\":%lld}}",
+                            event.name, track.tid, event.begin / 1e3, event.duration / 1e3, (long long)event.value);
+                        break;
+                    case Phase::Instant:
+                        fprintf(stream, ",\n{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                            event.name, track.tid, event.begin / 1e3, (long long)event.value);
+                        break;
+                    case Phase::Counter:
+                        fprintf(stream, ",\n{\"ph\":\"C\",\"name\":\"%s\",\"pid\":1,\"ts\":%.3f,\"args\":{\"value\":%lld}}",
+                            event.name, event.begin / 1e3, (long long)event.value);
+                        break;
+                    }
+                }
+            }
+            fprintf(stream, "\n],\"otherData\":{\"lost_events\":%llu}}\n", (unsigned long long)lost);
+            fflush(stream);
+            return events.size();
+        }
+
+        size_t write(std::string path) {
+            FILE *stream = fopen(path.c_str(), "w");
+            if (!stream) {
+                throw std::runtime_error("Couldn't open " + path + " for writing.");
+            }
+            auto written = write(stream);
+            fclose(stream);
+            return written;
+        }
+
+    private:
+        /// Takes a free buffer, starting after the last one handed out so
+        /// the events of threads that exited survive as long as possible. A
+        /// reused buffer starts over under a new thread id.
+        Buffer* claim() {
+            auto start = claims.fetch_add(1, std::memory_order_relaxed);
+            for (size_t i = 0; i < maxThreads; i += 1) {
+                auto &buffer = buffers[(start + i) % maxThreads];
+                bool expected = false;
+                if (buffer.claimed.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                    buffer.name.store(NULL, std::memory_order_relaxed);
+                    buffer.clear();
+                    buffer.tid.store(nextTid.fetch_add(1, std::memory_order_relaxed), std::memory_order_release);
+                    return &buffer;
+                }
+            }
+            return NULL;
+        }
+    };
+
+    /// Names the calling thread in dumps. Cheap enough to call on every
+    /// callback, which is the only hook we get into libuvc and libsoundio's
+    /// threads. `name` must be a string literal.
+    inline void nameThread(const char *name) {
+        if (!enabled().load(std::memory_order_relaxed)) {
+            return;
+        }
+        auto buffer = Recorder::shared().local();
+        if (buffer) {
+            buffer->name.store(name, std::memory_order_relaxed);
+        }
+    }
+
+    /// Marks a point in time, like an underflow or a dropped frame.
+    inline void instant(const char *name, int64_t value = 0) {
+        if (!enabled().load(std::memory_order_relaxed)) {
+            return;
+        }
+        auto buffer = Recorder::shared().local();
+        if (buffer) {
+            buffer->push({name, now(), 0, value, Phase::Instant});
+        }
+    }
+
+    /// Plots a value over time on its own track.
+    inline void counter(const char *name, int64_t value) {
+        if (!enabled().load(std::memory_order_relaxed)) {
+            return;
+        }
+        auto buffer = Recorder::shared().local();
+        if (buffer) {
+            buffer->push({name, now(), 0, value, Phase::Counter});
+        }
+    }
+
+    /// Records the lifetime of the scope as a span on the calling thread.
+    /// Costs one relaxed load while tracing is off. `name` must outlive the
+    /// recorder; string literals only.
+    struct Span {
+        const char *name;
+        int64_t value;
+        uint64_t begin = 0;
+        bool active;
+
+        Span(const char *name, int64_t value = 0): name(name), value(value), active(enabled().load(std::memory_order_relaxed)) {
+            if (active) {
+                begin = now();
+            }
+        }
+
+        ~Span() {
+            auto buffer = active ? Recorder::shared().local() : NULL;
+            if (buffer) {
+                buffer->push({name, begin, now() - begin, value, Phase::Complete});
+            }
+        }
+
+        ///This is a managed RAII resource. this object is not copyable
+        Span(Span const&) = delete;
+        Span& operator=(Span const&) = delete;
+    };
+
+    /// Starts recording, dropping anything left over from a previous run.
+    /// The first call allocates every buffer, on the calling thread.
+    inline void start() {
+        epoch();
+        Recorder::shared().clear();
+        enabled() = true;
+    }
+
+    inline void stop() {
+        enabled() = false;
+    }
+}
+
+#endif // _trace_hpp
@@ -3,9 +3,21 @@
 
 #include <libuvc/libuvc.h>
 
+#include <vector>
+#include <cstring> // memcmp
 #include <stdexcept>
 
 namespace UVC {
+    struct Mode {
+        int width;
+        int height;
+        int fps;
+
+        bool operator==(const Mode &other) const {
+            return width == other.width && height == other.height && fps == other.fps;
+        }
+    };
+
     struct Control: uvc_stream_ctrl_t {
         Control() {}
 
@@ -56,6 +68,26 @@ namespace UVC {
             return control;
         }
 
+        /// Every YUYV resolution and frame rate the device advertises.
+        std::vector<Mode> modes() {
+            std::vector<Mode> result;
+            for (auto format = uvc_get_format_descs(internal); format; format = format->next) {
+                if (format->bDescriptorSubtype != UVC_VS_FORMAT_UNCOMPRESSED || memcmp(format->guidFormat, "YUY2", 4)) {
+                    continue;
+                }
+                for (auto frame = format->frame_descs; frame; frame = frame->next) {
+                    if (frame->intervals) {
+                        for (auto interval = frame->intervals; *interval; interval += 1) {
+                            result.push_back({frame->wWidth, frame->wHeight, (int)(10000000 / *interval)});
+                        }
+                    } else if (frame->dwDefaultFrameInterval) {
+                        result.push_back({frame->wWidth, frame->wHeight, (int)(10000000 / frame->dwDefaultFrameInterval)});
+                    }
+                }
+            }
+            return result;
+        }
+
         void start(Control& control, uvc_frame_callback_t callback, void* userPointer = NULL) {
             auto error = uvc_start_streaming(internal, (uvc_stream_ctrl_t*)&control, callback, userPointer, 0);
 
@@ -69,8 +101,10 @@ namespace UVC {
         }
 
         void endStream() {
-            streaming = false;
-            uvc_stop_streaming(internal);
+            if (streaming) {
+                streaming = false;
+                uvc_stop_streaming(internal);
+            }
         }
 
     };
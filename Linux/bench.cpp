@@ -0,0 +1,690 @@
+// Microbenchmarks for the capture hot paths.
+//
+// Results go to stdout (or --output) as JSON so runs on different commits
+// can be diffed. Progress goes to stderr.
+
+#include <map>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#include "SSCO.hpp"
+#include "Async.hpp"
+#include "Frame.hpp"
+#include "Change.hpp"
+#include "Convert.hpp"
+#include "Scopes.hpp"
+#include "SoundIO.hpp"
+#include "Ring.hpp"
+#include "Trace.hpp"
+#include "Codec.hpp"
+#include "Deinterlace.hpp"
+#include "Replay.hpp"
+
+typedef std::chrono::steady_clock Clock;
+typedef std::map<std::string, std::string> Params;
+
+struct Result {
+    std::string name;
+    Params params;
+    uint64_t iterations;
+    double nsPerOp;
+    double bytesPerOp;
+};
+
+struct Bench {
+    std::string filter;
+    double minTime = 0.05;
+    int samples = 5;
+    std::vector<Result> results;
+
+    bool wanted(const std::string &name) {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    }
+
+    /// Runs `op` in batches long enough to be measurable and records the
+    /// median time per op over several batches.
+    void run(std::string name, Params params, double bytesPerOp, std::function<void()> op) {
+        if (!wanted(name)) {
+            return;
+        }
+
+        op(); // warm caches and lazily allocated state
+
+        uint64_t batch = 1;
+        for (;;) {
+            auto start = Clock::now();
+            for (uint64_t i = 0; i < batch; i += 1) {
+                op();
+            }
+            double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+            if (elapsed >= minTime || batch >= (1ull << 40)) {
+                break;
+            }
+            batch = elapsed > 0 ? std::max(batch * 2, (uint64_t)(batch * minTime / elapsed * 1.1)) : batch * 10;
+        }
+
+        std::vector<double> perOp;
+        for (int sample = 0; sample < samples; sample += 1) {
+            auto start = Clock::now();
+            for (uint64_t i = 0; i < batch; i += 1) {
+                op();
+            }
+            double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+            perOp.push_back(elapsed / batch);
+        }
+        std::sort(perOp.begin(), perOp.end());
+
+        report({name, params, batch * samples, perOp[perOp.size() / 2], bytesPerOp});
+    }
+
+    /// Records a result measured by the caller (for multi-threaded cases
+    /// where the batch loop above doesn't apply).
+    void record(std::string name, Params params, uint64_t iterations, double totalNs, double bytesPerOp) {
+        if (!wanted(name)) {
+            return;
+        }
+        report({name, params, iterations, totalNs / iterations, bytesPerOp});
+    }
+
+    void report(Result result) {
+        fprintf(stderr, "%-24s", result.name.c_str());
+        for (auto &param: result.params) {
+            fprintf(stderr, " %s=%s", param.first.c_str(), param.second.c_str());
+        }
+        fprintf(stderr, ": %.1f ns/op", result.nsPerOp);
+        if (result.bytesPerOp > 0) {
+            fprintf(stderr, ", %.2f GB/s", result.bytesPerOp / result.nsPerOp);
+        }
+        fprintf(stderr, "\n");
+        results.push_back(result);
+    }
+
+    void printJSON(FILE *stream) {
+        fprintf(stream, "{\n  \"compiler\": \"%s\",\n  \"results\": [\n", __VERSION__);
+        for (size_t i = 0; i < results.size(); i += 1) {
+            auto &result = results[i];
+            fprintf(stream, "    {\"name\": \"%s\", \"params\": {", result.name.c_str());
+            bool first = true;
+            for (auto &param: result.params) {
+                fprintf(stream, "%s\"%s\": \"%s\"", first ? "" : ", ", param.first.c_str(), param.second.c_str());
+                first = false;
+            }
+            fprintf(stream, "}, \"iterations\": %llu, \"ns_per_op\": %.3f", (unsigned long long)result.iterations, result.nsPerOp);
+            if (result.bytesPerOp > 0) {
+                fprintf(stream, ", \"bytes_per_second\": %.0f", result.bytesPerOp / result.nsPerOp * 1e9);
+            }
+            fprintf(stream, "}%s\n", i + 1 == results.size() ? "" : ",");
+        }
+        fprintf(stream, "  ]\n}\n");
+    }
+};
+
+static std::vector<uint8_t> noise(size_t bytes, unsigned seed = 1) {
+    std::vector<uint8_t> data(bytes);
+    for (auto &byte: data) {
+        seed = seed * 1103515245 + 12345;
+        byte = seed >> 16;
+    }
+    return data;
+}
+
+/// Something camera-like for the codec: smooth gradients with a little
+/// sensor noise, since noise() is incompressible by design.
+static std::vector<uint8_t> scene(int width, int height, unsigned seed = 1) {
+    std::vector<uint8_t> data(width * height * 2);
+    for (int y = 0; y < height; y += 1) {
+        for (int x = 0; x < width * 2; x += 1) {
+            seed = seed * 1103515245 + 12345;
+            int grain = (seed >> 16) % 5;
+            int value = (x & 1) ? 128 + ((x / 64 + y / 64) % 20) : (x / 8 + y / 4) % 220;
+            data[y * width * 2 + x] = value + grain;
+        }
+    }
+    return data;
+}
+
+struct Resolution {
+    int width;
+    int height;
+};
+
+static const std::vector<Resolution> resolutions = {
+    {640, 480},
+    {1280, 720},
+    {1920, 1080},
+    {3840, 2160},
+};
+
+static std::string str(int value) {
+    return std::to_string(value);
+}
+
+static void benchVideo(Bench &bench) {
+    for (auto resolution: resolutions) {
+        int w = resolution.width, h = resolution.height;
+        Params params = {{"width", str(w)}, {"height", str(h)}};
+        auto yuyv = noise(w * h * 2);
+        std::vector<uint8_t> bgr(w * h * 3);
+
+        bench.run("convert.yuyv_bgr", params, yuyv.size(), [&]() {
+            Convert::yuyvToBgr(yuyv.data(), w * 2, bgr.data(), w * 3, 0, w, 0, h);
+        });
+
+        Video::ChangeDetector detector;
+        bench.run("change.hash", params, yuyv.size(), [&]() {
+            detector.update(yuyv.data(), w * 2, w, h);
+        });
+
+        Scopes::Accumulator accumulator;
+        bench.run("scopes.accumulate", params, yuyv.size(), [&]() {
+            accumulator.accumulate(yuyv.data(), w * 2, w, h);
+        });
+
+        Scopes::Accumulator striped(2, 2);
+        bench.run("scopes.accumulate", {{"width", str(w)}, {"height", str(h)}, {"threads", "2"}}, yuyv.size(), [&]() {
+            striped.accumulate(yuyv.data(), w * 2, w, h);
+        });
+        if (bench.wanted("scopes.accumulate") && (memcmp(striped.histogram, accumulator.histogram, sizeof accumulator.histogram) || striped.waveform != accumulator.waveform || striped.vectorscope != accumulator.vectorscope)) {
+            throw std::runtime_error("striped scopes disagree with a single stripe");
+        }
+
+        std::vector<uint8_t> panel(Scopes::panelWidth * Scopes::panelHeight * 3);
+        bench.run("scopes.render", params, 0, [&]() {
+            Scopes::render(accumulator, panel.data(), (h / 2) * w / Scopes::waveformColumns);
+        });
+
+        std::vector<uint8_t> copy(yuyv.size());
+        bench.run("frame.memcpy", params, yuyv.size(), [&]() {
+            memcpy(copy.data(), yuyv.data(), yuyv.size());
+        });
+    }
+}
+
+static void benchFrameHandoff(Bench &bench) {
+    if (!bench.wanted("frame.handoff")) {
+        return;
+    }
+    for (auto resolution: resolutions) {
+        int w = resolution.width, h = resolution.height;
+        auto yuyv = noise(w * h * 2);
+
+        uvc_frame_t source = {};
+        source.data = yuyv.data();
+        source.data_bytes = yuyv.size();
+        source.width = w;
+        source.height = h;
+        source.step = w * 2;
+        source.frame_format = UVC_FRAME_FORMAT_YUYV;
+
+        // Capture thread copies into the pool and posts, consumer thread
+        // drops the reference, which hands the frame back to the pool.
+        Video::FramePool pool(4, yuyv.size());
+        const uint64_t frames = std::max(64, 400000000 / (w * h * 2));
+        uint64_t dropped = 0;
+        auto start = Clock::now();
+        {
+            Async::Worker consumer;
+            for (uint64_t i = 0; i < frames; i += 1) {
+                Video::FrameRef frame;
+                while (!(frame = pool.acquire())) {
+                    std::this_thread::yield();
+                    dropped += 1;
+                }
+                frame->copyFrom(&source);
+                consumer.post([frame]() {});
+            }
+        }
+        double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        bench.record("frame.handoff", {{"width", str(w)}, {"height", str(h)}, {"stalls", std::to_string(dropped)}}, frames, elapsed, yuyv.size());
+    }
+}
+
+static void benchCodec(Bench &bench) {
+    for (auto resolution: resolutions) {
+        int w = resolution.width, h = resolution.height;
+        auto yuyv = scene(w, h);
+        std::vector<uint8_t> packed(Codec::bound(w * 2, h));
+        std::vector<uint8_t> unpacked(yuyv.size());
+        size_t bytes = Codec::compress(yuyv.data(), w * 2, w * 2, h, packed.data());
+        char ratio[16];
+        snprintf(ratio, sizeof ratio, "%.2f", (double)yuyv.size() / bytes);
+        Params params = {{"width", str(w)}, {"height", str(h)}, {"ratio", ratio}};
+
+        bench.run("codec.compress", params, yuyv.size(), [&]() {
+            Codec::compress(yuyv.data(), w * 2, w * 2, h, packed.data());
+        });
+        bench.run("codec.decompress", params, yuyv.size(), [&]() {
+            Codec::decompress(packed.data(), bytes, unpacked.data(), w * 2, w * 2, h);
+        });
+        if (unpacked != yuyv && bench.wanted("codec.decompress")) {
+            fprintf(stderr, "codec round trip mismatch at %dx%d\n", w, h);
+            exit(1);
+        }
+    }
+}
+
+// 1080i60 delivers 30 frames of two fields a second, so each frame has to
+// be done (both fields, when doubling) well inside 33ms.
+static void benchDeinterlace(Bench &bench) {
+    int w = 1920, h = 1080;
+    auto first = scene(w, h, 1), second = scene(w, h, 2);
+    uvc_frame_t frame = {};
+    frame.data_bytes = first.size();
+    frame.width = w;
+    frame.height = h;
+    frame.step = w * 2;
+    frame.frame_format = UVC_FRAME_FORMAT_YUYV;
+
+    std::vector<size_t> threadCounts = {1};
+    if (std::thread::hardware_concurrency() > 1) {
+        threadCounts.push_back(std::min(4u, std::thread::hardware_concurrency()));
+    }
+    for (auto mode: {Video::Deinterlace::Bob, Video::Deinterlace::Blend, Video::Deinterlace::Adaptive}) {
+        for (bool doubled: {false, true}) {
+            if (mode == Video::Deinterlace::Blend && doubled) {
+                continue;
+            }
+            for (auto threads: threadCounts) {
+                Video::Deinterlacer deinterlacer(mode, doubled, true, threads);
+                Params params = {{"mode", Video::deinterlaceName(mode)}, {"double", doubled ? "true" : "false"}, {"threads", std::to_string(threads)}, {"width", str(w)}, {"height", str(h)}, {"budget_ms", "33.3"}};
+                uvc_frame_t out[2];
+                uint64_t n = 0;
+                // Alternate inputs so the adaptive mode sees motion.
+                bench.run("deinterlace", params, first.size(), [&]() {
+                    frame.data = (n++ & 1) ? second.data() : first.data();
+                    deinterlacer.process(&frame, out);
+                });
+                // And what showing them costs on top, short of the window
+                // itself: each frame that goes out is converted for display.
+                std::vector<uint8_t> bgr(w * h * 3);
+                bench.run("deinterlace.present", params, first.size(), [&]() {
+                    frame.data = (n++ & 1) ? second.data() : first.data();
+                    int count = deinterlacer.process(&frame, out);
+                    for (int i = 0; i < count; i += 1) {
+                        Convert::yuyvToBgr((const uint8_t *)out[i].data, out[i].step, bgr.data(), w * 3, 0, w, 0, h);
+                    }
+                });
+            }
+        }
+    }
+}
+
+// The replay encoder's per frame cost: compress into the arena, evicting as
+// it goes. The arena only holds a few frames so wrapping is exercised too.
+static void benchReplay(Bench &bench) {
+    for (auto resolution: resolutions) {
+        int w = resolution.width, h = resolution.height;
+        auto yuyv = scene(w, h);
+        uvc_frame_t frame = {};
+        frame.data = yuyv.data();
+        frame.data_bytes = yuyv.size();
+        frame.width = w;
+        frame.height = h;
+        frame.step = w * 2;
+        frame.frame_format = UVC_FRAME_FORMAT_YUYV;
+        Replay::Store store(yuyv.size() * 4, 256, 60000000000ull);
+        Params params = {{"width", str(w)}, {"height", str(h)}, {"budget_ms", "16.7"}};
+        uint64_t timestamp = 0;
+        bench.run("replay.store", params, yuyv.size(), [&]() {
+            auto header = Record::describe(&frame, timestamp += 16666667);
+            auto at = store.reserve(sizeof header + Record::maxPayload(header));
+            Record::encode(header, yuyv.data(), at + sizeof header);
+            memcpy(at, &header, sizeof header);
+            store.commit(sizeof header + header.payloadBytes, header.timestamp);
+        });
+    }
+}
+
+// What a span costs on the capture and audio threads, recording or not.
+static void benchTrace(Bench &bench) {
+    Trace::stop();
+    bench.run("trace.span", {{"recording", "false"}}, 0, [&]() {
+        Trace::Span span("bench");
+    });
+    Trace::start();
+    bench.run("trace.span", {{"recording", "true"}}, 0, [&]() {
+        Trace::Span span("bench");
+    });
+    Trace::stop();
+}
+
+static const std::vector<int> channelCounts = {1, 2, 6, 8};
+static const std::vector<int> sampleSizes = {1, 2, 3, 4, 8};
+static const int period = 512;
+
+static void benchAudioCopy(Bench &bench) {
+    for (auto channels: channelCounts) {
+        for (auto bytesPerSample: sampleSizes) {
+            Params params = {{"channels", str(channels)}, {"bytes_per_sample", str(bytesPerSample)}, {"frames", str(period)}};
+            int bytesPerFrame = channels * bytesPerSample;
+            auto device = noise(period * bytesPerFrame);
+            std::vector<uint8_t> ring(period * bytesPerFrame);
+
+            // Interleaved device buffer, as ALSA and PulseAudio hand us.
+            SoundIoChannelArea areas[SOUNDIO_MAX_CHANNELS];
+            auto reset = [&]() {
+                for (int ch = 0; ch < channels; ch += 1) {
+                    areas[ch].ptr = (char*)device.data() + ch * bytesPerSample;
+                    areas[ch].step = bytesPerFrame;
+                }
+            };
+
+            bench.run("audio.read_areas", params, device.size(), [&]() {
+                reset();
+                SoundIO::readAreas(areas, channels, bytesPerSample, period, (char*)ring.data());
+            });
+            bench.run("audio.write_areas", params, device.size(), [&]() {
+                reset();
+                SoundIO::writeAreas(areas, channels, bytesPerSample, period, (const char*)ring.data());
+            });
+            bench.run("audio.silence_areas", params, device.size(), [&]() {
+                reset();
+                SoundIO::silenceAreas(areas, channels, bytesPerSample, period);
+            });
+        }
+    }
+}
+
+static void benchRingBuffer(Bench &bench) {
+    auto soundio = soundio_create();
+    if (!soundio) {
+        throw std::runtime_error("Failed to create SoundIO context.");
+    }
+    for (auto channels: channelCounts) {
+        for (auto bytesPerSample: {2, 4}) {
+            Params params = {{"channels", str(channels)}, {"bytes_per_sample", str(bytesPerSample)}, {"frames", str(period)}};
+            int chunk = period * channels * bytesPerSample;
+            auto ring = soundio_ring_buffer_create(soundio, chunk * 8);
+            auto source = noise(chunk);
+            std::vector<uint8_t> sink(chunk);
+
+            bench.run("ring.soundio_push_pop", params, chunk, [&]() {
+                memcpy(soundio_ring_buffer_write_ptr(ring), source.data(), chunk);
+                soundio_ring_buffer_advance_write_ptr(ring, chunk);
+                memcpy(sink.data(), soundio_ring_buffer_read_ptr(ring), chunk);
+                soundio_ring_buffer_advance_read_ptr(ring, chunk);
+            });
+
+            soundio_ring_buffer_destroy(ring);
+
+            Audio::Ring frameRing(period * 8, channels * bytesPerSample);
+            int reader = frameRing.addReader();
+            bench.run("ring.frame_push_pop", params, chunk, [&]() {
+                frameRing.write(source.data(), period);
+                frameRing.read(reader, sink.data(), period);
+            });
+        }
+    }
+    soundio_destroy(soundio);
+}
+
+/// Moves `total` frames of `bytesPerFrame` from one thread to another,
+/// `chunk` frames at a time, spinning when full or empty. Returns ns.
+template <typename Push, typename Pop>
+static double stream(uint64_t total, Push push, Pop pop) {
+    auto start = Clock::now();
+    std::thread consumer([&]() {
+        uint64_t received = 0;
+        while (received < total) {
+            auto count = pop();
+            if (!count) {
+                std::this_thread::yield();
+            }
+            received += count;
+        }
+    });
+    uint64_t sent = 0;
+    while (sent < total) {
+        auto count = push(total - sent);
+        if (!count) {
+            std::this_thread::yield();
+        }
+        sent += count;
+    }
+    consumer.join();
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+static void benchRingThroughput(Bench &bench) {
+    if (!bench.wanted("ring.throughput")) {
+        return;
+    }
+    const int channels = 2, bytesPerSample = 4, bytesPerFrame = channels * bytesPerSample;
+    const uint64_t total = 1 << 24;
+    auto source = noise(period * bytesPerFrame);
+    std::vector<uint8_t> sink(period * bytesPerFrame);
+
+    auto soundio = soundio_create();
+    auto ring = soundio_ring_buffer_create(soundio, period * 8 * bytesPerFrame);
+    auto elapsed = stream(total, [&](uint64_t left) -> uint64_t {
+        int frames = std::min<uint64_t>({(uint64_t)period, left, (uint64_t)(soundio_ring_buffer_free_count(ring) / bytesPerFrame)});
+        memcpy(soundio_ring_buffer_write_ptr(ring), source.data(), frames * bytesPerFrame);
+        soundio_ring_buffer_advance_write_ptr(ring, frames * bytesPerFrame);
+        return frames;
+    }, [&]() -> uint64_t {
+        int frames = std::min(period, soundio_ring_buffer_fill_count(ring) / bytesPerFrame);
+        memcpy(sink.data(), soundio_ring_buffer_read_ptr(ring), frames * bytesPerFrame);
+        soundio_ring_buffer_advance_read_ptr(ring, frames * bytesPerFrame);
+        return frames;
+    });
+    bench.record("ring.throughput", {{"ring", "soundio"}, {"readers", "1"}}, total, elapsed, bytesPerFrame);
+    soundio_ring_buffer_destroy(ring);
+    soundio_destroy(soundio);
+
+    for (int readers: {1, 3}) {
+        Audio::Ring frameRing(period * 8, bytesPerFrame);
+        std::vector<int> ids;
+        for (int i = 0; i < readers; i += 1) {
+            ids.push_back(frameRing.addReader());
+        }
+        // Extra readers follow on their own threads; the timed consumer is
+        // reader 0.
+        std::atomic<bool> done{false};
+        std::vector<std::thread> followers;
+        for (int i = 1; i < readers; i += 1) {
+            followers.emplace_back([&, i]() {
+                std::vector<uint8_t> local(period * bytesPerFrame);
+                while (!done.load(std::memory_order_relaxed)) {
+                    if (!frameRing.read(ids[i], local.data(), period)) {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        auto elapsed = stream(total, [&](uint64_t left) -> uint64_t {
+            return frameRing.write(source.data(), std::min<uint64_t>(period, left));
+        }, [&]() -> uint64_t {
+            return frameRing.read(ids[0], sink.data(), period);
+        });
+        done = true;
+        for (auto &follower: followers) {
+            follower.join();
+        }
+        bench.record("ring.throughput", {{"ring", "frame"}, {"readers", str(readers)}}, total, elapsed, bytesPerFrame);
+    }
+}
+
+/// Hammers the frame ring with one producer, two blocking readers and one
+/// lossy reader. Every frame carries its own sequence number; blocking
+/// readers must see every frame in order, the lossy reader must only ever
+/// move forward and never see a torn frame.
+static uint64_t stressRing(Bench &bench) {
+    if (!bench.wanted("ring.stress")) {
+        return 0;
+    }
+    const size_t words = 4; // 32 byte frames
+    const uint64_t total = 1 << 23;
+    Audio::Ring ring(1024, words * sizeof(uint64_t));
+    int blockingA = ring.addReader(), blockingB = ring.addReader(), lossy = ring.addReader(false);
+    std::atomic<uint64_t> errors{0};
+    std::atomic<bool> done{false};
+
+    auto check = [&](int reader, bool contiguous) {
+        std::vector<uint64_t> chunk(97 * words);
+        uint64_t expected = 0;
+        while (expected < total) {
+            if (!contiguous && (expected & 0xFFF) < 97) {
+                // Stall now and then so the producer laps the lossy reader.
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            auto count = ring.read(reader, chunk.data(), 97);
+            if (!count) {
+                if (!contiguous && done.load()) {
+                    return;
+                }
+                std::this_thread::yield();
+                continue;
+            }
+            for (size_t i = 0; i < count; i += 1) {
+                auto frame = &chunk[i * words];
+                bool torn = false;
+                for (size_t w = 1; w < words; w += 1) {
+                    torn |= frame[w] != frame[0] * (w + 1);
+                }
+                if (torn || (contiguous ? frame[0] != expected : frame[0] < expected)) {
+                    errors += 1;
+                }
+                expected = frame[0] + 1;
+            }
+        }
+    };
+
+    auto start = Clock::now();
+    std::thread a(check, blockingA, true), b(check, blockingB, true), c(check, lossy, false);
+    std::vector<uint64_t> chunk(61 * words);
+    uint64_t sent = 0;
+    while (sent < total) {
+        size_t count = std::min<uint64_t>(61, total - sent);
+        for (size_t i = 0; i < count; i += 1) {
+            for (size_t w = 0; w < words; w += 1) {
+                chunk[i * words + w] = (sent + i) * (w + 1);
+            }
+        }
+        auto written = ring.write(chunk.data(), count);
+        if (!written) {
+            std::this_thread::yield();
+        }
+        sent += written;
+    }
+    a.join();
+    b.join();
+    done = true;
+    c.join();
+    double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+    bench.record("ring.stress", {{"errors", std::to_string(errors.load())}, {"lossy_overruns", std::to_string(ring.overruns(lossy))}}, total, elapsed, words * sizeof(uint64_t));
+    if (errors) {
+        fprintf(stderr, "ring.stress: %llu bad frames\n", (unsigned long long)errors.load());
+    }
+    return errors;
+}
+
+/// Goes through every --audio_backend name the way main does and connects
+/// to the dummy backend, which libsoundio always has, so the option is
+/// exercised even on hosts without a sound server. Times the connect.
+static uint64_t checkBackends(Bench &bench) {
+    if (!bench.wanted("audio.backend")) {
+        return 0;
+    }
+    uint64_t errors = 0;
+    for (auto &entry: SoundIO::Context::backendNames()) {
+        auto backend = SoundIO::Context::backendByName(entry.first);
+        if (!backend.has_value() || backend.value() != entry.second) {
+            fprintf(stderr, "audio.backend: '%s' doesn't map back to its backend\n", entry.first.c_str());
+            errors += 1;
+        }
+    }
+    if (SoundIO::Context::backendByName("nonsense").has_value()) {
+        fprintf(stderr, "audio.backend: accepted an unknown name\n");
+        errors += 1;
+    }
+
+    const int connects = 20;
+    double elapsed = 0;
+    int inputs = 0, outputs = 0;
+    for (int i = 0; i < connects; i += 1) {
+        auto start = Clock::now();
+        SoundIO::Context context(SoundIO::Context::backendByName("dummy"));
+        elapsed += std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        if (context.currentBackend() != SoundIoBackendDummy) {
+            errors += 1;
+        }
+        inputs = context.inputDeviceCount();
+        outputs = context.outputDeviceCount();
+    }
+    if (!inputs || !outputs) {
+        fprintf(stderr, "audio.backend: dummy backend has %d inputs and %d outputs\n", inputs, outputs);
+        errors += 1;
+    }
+    bench.record("audio.backend_connect", {{"backend", "dummy"}, {"errors", std::to_string(errors)}}, connects, elapsed, 0);
+    return errors;
+}
+
+int main(int argc, char **argv) {
+    Bench bench;
+    std::string output;
+
+    SSCO::Options ssco({
+        {"help", 'h', "Show this message and exit.", false, [&](){ ssco.printHelp(std::cout); exit(0); }},
+        {"filter", 'f', "Only run benchmarks whose name contains this string.", true, std::nullopt},
+        {"min_time", 't', "Minimum seconds per measured batch. [Default: 0.05]", true, std::nullopt},
+        {"samples", 's', "Batches per benchmark; the median is reported. [Default: 5]", true, std::nullopt},
+        {"output", 'o', "File to write JSON results to. [Default: stdout]", true, std::nullopt},
+    });
+
+    auto opts = ssco.process(argc, argv);
+    if (!opts.has_value()) {
+        ssco.printHelp(std::cout);
+        return 64;
+    }
+    auto options = opts.value().options;
+
+    if (options.find("filter") != options.end()) {
+        bench.filter = options["filter"];
+    }
+    if (options.find("min_time") != options.end()) {
+        bench.minTime = std::atof(options["min_time"].c_str());
+    }
+    if (options.find("samples") != options.end()) {
+        bench.samples = std::max(1, std::atoi(options["samples"].c_str()));
+    }
+    if (options.find("output") != options.end()) {
+        output = options["output"];
+    }
+
+    benchVideo(bench);
+    benchFrameHandoff(bench);
+    benchTrace(bench);
+    benchCodec(bench);
+    benchDeinterlace(bench);
+    benchReplay(bench);
+    benchAudioCopy(bench);
+    benchRingBuffer(bench);
+    benchRingThroughput(bench);
+    auto failures = stressRing(bench);
+    failures += checkBackends(bench);
+
+    FILE *stream = stdout;
+    if (!output.empty()) {
+        stream = fopen(output.c_str(), "w");
+        if (!stream) {
+            std::cerr << "Couldn't open " << output << " for writing." << std::endl;
+            return 73;
+        }
+    }
+    bench.printJSON(stream);
+    if (stream != stdout) {
+        fclose(stream);
+    }
+    return failures ? 1 : 0;
+}
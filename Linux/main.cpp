@@ -4,8 +4,11 @@
 #include <opencv2/core/core_c.h>
 #include <opencv2/highgui/highgui_c.h>
 
+#include <atomic>
 #include <thread>
 #include <memory>
+#include <sstream>
+#include <algorithm>
 #include <csignal>
 #include <iostream>
 #include <stdexcept>
@@ -14,58 +17,595 @@
 #include "SSCO.hpp"
 #include "UVC.hpp"
 #include "SoundIO.hpp"
+#include "Ring.hpp"
+#include "Calibration.hpp"
+#include "Frame.hpp"
+#include "Metrics.hpp"
+#include "Demand.hpp"
+#include "Preview.hpp"
+#include "Scopes.hpp"
+#include "Control.hpp"
+#include "Snapshot.hpp"
+#include "Trace.hpp"
+#include "Record.hpp"
+#include "Deinterlace.hpp"
+#include "Replay.hpp"
 
 static sem_t closingSemaphore;
 void signalHandler(int signum) {
     sem_post(&closingSemaphore);
 }
 
-void video_callback(uvc_frame_t *frame, void *ptr) {
-    uvc_frame_t *bgr;
-    uvc_error_t ret;
-    /* We'll convert the image from YUV/JPEG to BGR, so allocate space */
-    bgr = uvc_allocate_frame(frame->width * frame->height * 3);
-    if (!bgr) {
-        printf("unable to allocate bgr frame!");
+Video::FramePool *snapshot_pool = NULL;
+Snapshot::Writer *snapshot_writer = NULL;
+static int snapshot_burst = 1;
+static std::atomic<int> snapshot_requests{0};
+static Metrics::Counter snapshot_dropped("snapshot.dropped");
+
+void snapshotSignalHandler(int signum) {
+    snapshot_requests += snapshot_burst;
+}
+
+static void take_snapshot(uvc_frame_t *frame) {
+    if (!snapshot_writer || snapshot_requests <= 0) {
         return;
     }
-    /* Do the BGR conversion */
-    ret = uvc_any2bgr(frame, bgr);
-    if (ret) {
-        uvc_perror(ret, "uvc_any2bgr");
-        uvc_free_frame(bgr);
+    snapshot_requests -= 1;
+
+    // Only a copy into a pooled frame happens here, encoding is deferred.
+    auto pooled = snapshot_pool->acquire();
+    if (!pooled || !pooled->copyFrom(frame)) {
+        snapshot_dropped.add();
+        Trace::instant("snapshot.dropped");
         return;
     }
-    
-    auto cvImg = cvCreateImageHeader(
-        cvSize(bgr->width, bgr->height),
-        IPL_DEPTH_8U,
-        3);
-    
-    cvSetData(cvImg, bgr->data, bgr->width * 3); 
-    
-    cvShowImage("UVC Viewer", cvImg);
-    cvWaitKey(10);
-    
-    cvReleaseImageHeader(&cvImg);
-    uvc_free_frame(bgr);
+    snapshot_writer->capture(pooled);
+}
+
+Video::Demand video_demand;
+Video::Preview *video_preview = NULL;
+Scopes::Overlay *video_scopes = NULL;
+static Metrics::Counter idle_frames("video.idle_frames");
+
+static Control::Channel control_channel;
+static std::atomic<bool> switch_pending{false};
+static Metrics::Clock::time_point switch_started;
+static Metrics::Timer switch_time("video.switch");
+static Metrics::Timer switch_first_frame("video.switch_first_frame");
+static Metrics::Timer callback_time("video.callback");
+
+static std::string trace_file = "uvc-trace.json";
+static std::atomic<int> trace_toggles{0};
+
+void traceSignalHandler(int signum) {
+    trace_toggles += 1;
+}
+
+static std::shared_ptr<Record::Recorder> video_recorder;
+static size_t record_threads = 1;
+static std::atomic<size_t> last_frame_bytes{0};
+Record::Player *video_player = NULL;
+Video::Deinterlacer *video_deinterlacer = NULL;
+Replay::Buffer *video_replay = NULL;
+static std::shared_ptr<Replay::Viewer> replay_viewer;
+static Async::Worker *replay_dumper = NULL;
+
+/// How big the replay buffer gets. A --replay_memory from the command line
+/// stays put; otherwise it's what the seconds need at the mode streaming
+/// right now, up to `cap`.
+struct ReplaySizing {
+    double seconds = 0;
+    size_t frameBytes = 0;
+    size_t audioBytes = 0;
+    size_t fixed = 0;
+    size_t cap = 0;
+
+    /// What `mode` needs, before the cap.
+    size_t wanted(UVC::Mode mode) {
+        return Replay::Buffer::memoryFor(seconds, mode.width * mode.height * 2.0 * mode.fps, frameBytes, audioBytes);
+    }
+
+    size_t budget(UVC::Mode mode) {
+        return fixed ? fixed : std::min(cap, wanted(mode));
+    }
+};
+static ReplaySizing replay_sizing;
+
+/// Deinterlaces if asked to and shows the result. Doubled frames go out
+/// half a frame apart, the second from the preview's thread so this one can
+/// get back to libuvc. Snapshots and recordings keep the original fields.
+static int present_frame(uvc_frame_t *frame) {
+    // The second field of the last pair may still be on its way out of the
+    // deinterlacer's buffer.
+    video_preview->settle();
+    uvc_frame_t progressive[2];
+    int count = video_deinterlacer->process(frame, progressive);
+    if (count == 0) {
+        video_scopes->offer(frame);
+        return video_preview->present(frame);
+    }
+
+    video_scopes->offer(&progressive[0]);
+    if (count == 1) {
+        return video_preview->present(&progressive[0]);
+    }
+    // Events still get pumped when the second field goes out, so there's no
+    // need to hold on to this thread waiting for keys.
+    int key = video_preview->present(&progressive[0], 1);
+    video_preview->presentAt(&progressive[1], video_deinterlacer->secondFieldDue());
+    return key;
+}
+
+static void record_frame(uvc_frame_t *frame) {
+    auto recorder = std::atomic_load(&video_recorder);
+    if (recorder) {
+        recorder->capture(frame);
+    }
+}
+
+/// Keeps the frame for instant replay, and hands back the replayed frame to
+/// show instead while a replay is on. Its pixels belong to `viewer`, which
+/// has to be held until it's been shown: the control channel can swap the
+/// viewer out at any time.
+static uvc_frame_t* replay_frame(uvc_frame_t *frame, uvc_frame_t &replayed, std::shared_ptr<Replay::Viewer> &viewer) {
+    if (!video_replay) {
+        return frame;
+    }
+    video_replay->capture(frame);
+    viewer = std::atomic_load(&replay_viewer);
+    if (!viewer) {
+        return frame;
+    }
+    if (viewer->finished()) {
+        std::atomic_store(&replay_viewer, std::shared_ptr<Replay::Viewer>());
+        fprintf(stderr, "Replay finished, back to live.\n");
+        return frame;
+    }
+    auto shown = viewer->current();
+    if (!shown) {
+        return frame;
+    }
+    replayed = Record::view(*shown);
+    return &replayed;
+}
+
+void video_callback(uvc_frame_t *frame, void *ptr) {
+    Trace::nameThread("uvc");
+    Trace::Span span("uvc.frame", frame->sequence);
+    Metrics::Scope scope(callback_time);
+    last_frame_bytes.store(frame->data_bytes, std::memory_order_relaxed);
+
+    if (switch_pending.exchange(false)) {
+        Trace::instant("video.switch_first_frame");
+        auto elapsed = Metrics::nanosecondsSince(switch_started);
+        switch_first_frame.record(elapsed);
+        fprintf(stderr, "First %dx%d frame %.1fms after the switch began.\n", frame->width, frame->height, elapsed / 1e6);
+    }
+
+    // Only run the stages someone downstream is waiting for.
+    video_preview->refresh();
+    int key = -1;
+    if (!video_demand.any() && snapshot_requests <= 0) {
+        idle_frames.add();
+        key = video_preview->idle();
+    } else {
+        take_snapshot(frame);
+        record_frame(frame);
+        uvc_frame_t replayed;
+        std::shared_ptr<Replay::Viewer> viewer;
+        auto shown = replay_frame(frame, replayed, viewer);
+        if (video_preview->wanted()) {
+            // The scopes are only ever seen on top of the preview.
+            key = present_frame(shown);
+        } else {
+            key = video_preview->idle();
+        }
+    }
+
+    if (key == 's' || key == 'S') {
+        snapshot_requests += snapshot_burst;
+    }
+    if (key == 'c' || key == 'C') {
+        video_scopes->toggle();
+    }
+    // Mode switches restart the stream, which can't be done from here.
+    if (key == 'm') {
+        control_channel.post("next");
+    }
+    if (key == 'M') {
+        control_channel.post("previous");
+    }
+    // Dumping does file I/O, so that happens on the main thread too.
+    if (key == 't' || key == 'T') {
+        control_channel.post("trace");
+    }
+    if (key == 'i' || key == 'I') {
+        control_channel.post("deinterlace next");
+    }
+    if (key == 'r' || key == 'R') {
+        control_channel.post("record");
+    }
+    if (key == ' ') {
+        control_channel.post("play pause");
+    }
+    if (key == '[') {
+        control_channel.post("play seek -5");
+    }
+    if (key == ']') {
+        control_channel.post("play seek +5");
+    }
+    if (key == 'p' || key == 'P') {
+        control_channel.post("replay show");
+    }
+    if (key == 'd' || key == 'D') {
+        control_channel.post("replay dump");
+    }
 }
 
-struct SoundIoRingBuffer *ring_buffer = NULL;
+/// Everything libuvc: context, device and open handle, torn down in reverse.
+struct Capture {
+    UVC::Context context;
+    UVC::Device device;
+    UVC::Handle handle;
+
+    Capture(): device(context.getDevice()), handle(device.getHandle()) {}
+};
+
+/// The UVC stream and the mode it runs in. Only used from the main thread.
+struct VideoStream {
+    UVC::Handle &handle;
+    FILE *diagnostics;
+    UVC::Mode mode = {0, 0, 0};
+    std::vector<UVC::Mode> modes;
+
+    VideoStream(UVC::Handle &handle, FILE *diagnostics): handle(handle), diagnostics(diagnostics), modes(handle.modes()) {}
+
+    void start(UVC::Mode requested) {
+        auto control = handle.getControl(UVC_FRAME_FORMAT_YUYV, requested.width, requested.height, requested.fps);
+        if (diagnostics) control.printData(diagnostics);
+
+        // Grow the pools before frames of the new size can arrive.
+        snapshot_pool->reserve(requested.width * requested.height * 2);
+        video_scopes->pool.reserve(requested.width * requested.height * 2);
+        auto recorder = std::atomic_load(&video_recorder);
+        if (recorder) {
+            recorder->pool.reserve(requested.width * requested.height * 2);
+        }
+        if (video_replay) {
+            video_replay->resize(replay_sizing.budget(requested));
+        }
+
+        handle.start(control, video_callback);
+        mode = requested;
+    }
+
+    /// Stops the stream and renegotiates. Audio is untouched, and the preview
+    /// resizes itself when the first frame of the new size shows up. If the
+    /// device refuses the new mode, the old one is restored.
+    std::string change(UVC::Mode requested) {
+        if (requested == mode) {
+            return "ok: already " + describe(mode);
+        }
+        auto previous = mode;
+
+        switch_started = Metrics::Clock::now();
+        Trace::instant("video.switch");
+        handle.endStream();
+        switch_pending = true;
+        try {
+            start(requested);
+        } catch (std::runtime_error &error) {
+            try {
+                start(previous);
+            } catch (std::runtime_error &fallback) {
+                // Leaves the stream stopped; `mode W H FPS` or `next` starts it again.
+                mode = {0, 0, 0};
+                return std::string("error: ") + error.what() + ", and restoring " + describe(previous) + " failed too: " + fallback.what() + ". Video is stopped.";
+            }
+            return std::string("error: ") + error.what();
+        }
+        auto elapsed = Metrics::nanosecondsSince(switch_started);
+        switch_time.record(elapsed);
+
+        char message[96];
+        snprintf(message, sizeof message, "ok: %s, restarted in %.1fms", describe(mode).c_str(), elapsed / 1e6);
+        return message;
+    }
+
+    /// Steps through the advertised modes.
+    std::string cycle(int direction) {
+        if (modes.empty()) {
+            return "error: device didn't advertise any YUYV modes";
+        }
+        int index = -1;
+        for (size_t i = 0; i < modes.size(); i += 1) {
+            if (modes[i] == mode) {
+                index = i;
+            }
+        }
+        index = (index + direction + modes.size()) % modes.size();
+        return change(modes[index]);
+    }
+
+    static std::string describe(UVC::Mode mode) {
+        return std::to_string(mode.width) + "x" + std::to_string(mode.height) + "@" + std::to_string(mode.fps);
+    }
+};
+
+/// `trace` toggles, `trace on` starts afresh, `trace off` stops and dumps,
+/// `trace dump [PATH]` writes what's recorded so far and keeps going.
+static std::string run_trace(std::istringstream &words) {
+    std::string action, path;
+    words >> action >> path;
+    if (path.empty()) {
+        path = trace_file;
+    }
+    if (action.empty()) {
+        action = Trace::enabled() ? "off" : "on";
+    }
+
+    if (action == "on") {
+        Trace::start();
+        return "ok: tracing";
+    }
+    if (action != "off" && action != "dump") {
+        return "error: expected trace, trace on, trace off or trace dump [PATH]";
+    }
+    if (action == "off") {
+        Trace::stop();
+    }
+    try {
+        auto written = Trace::Recorder::shared().write(path);
+        return "ok: wrote " + std::to_string(written) + " events to " + path;
+    } catch (std::runtime_error &error) {
+        return std::string("error: ") + error.what();
+    }
+}
+
+static std::string start_recording(std::string path, size_t frameBytes) {
+    if (std::atomic_load(&video_recorder)) {
+        return "error: already recording";
+    }
+    if (path.empty()) {
+        char name[64];
+        auto now = time(NULL);
+        strftime(name, sizeof name, "recording-%Y%m%d-%H%M%S.uvcr", localtime(&now));
+        path = name;
+    }
+    try {
+        std::atomic_store(&video_recorder, std::make_shared<Record::Recorder>(video_demand, path, record_threads, frameBytes));
+    } catch (std::runtime_error &error) {
+        return std::string("error: ") + error.what();
+    }
+    return "ok: recording to " + path;
+}
+
+/// Waits for the capture thread to let go so the file is finished here
+/// rather than on the capture thread.
+static std::string stop_recording() {
+    auto recorder = std::atomic_exchange(&video_recorder, std::shared_ptr<Record::Recorder>());
+    if (!recorder) {
+        return "error: not recording";
+    }
+    while (recorder.use_count() > 1) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto path = recorder->path;
+    recorder.reset();
+    return "ok: saved " + path;
+}
+
+/// `play pause` toggles, `play resume` resumes, `play seek S` jumps to S
+/// seconds in and `play seek +S`/`-S` moves relative to the current frame.
+static std::string run_play(std::istringstream &words) {
+    if (!video_player) {
+        return "error: not playing a recording";
+    }
+    std::string action, where;
+    words >> action >> where;
+    if (action == "pause") {
+        video_player->setPaused(!video_player->paused);
+    } else if (action == "resume") {
+        video_player->setPaused(false);
+    } else if (action == "seek" && !where.empty()) {
+        double seconds = std::atof(where.c_str());
+        if (where[0] == '+' || where[0] == '-') {
+            seconds += video_player->position / 1e9;
+        }
+        video_player->seek(std::max(0.0, seconds) * 1e9);
+    } else if (!action.empty()) {
+        return "error: expected play pause, play resume or play seek [+-]SECONDS";
+    }
+
+    char state[96];
+    snprintf(state, sizeof state, "ok: %s at %.2fs of %.2fs", video_player->paused ? "paused" : "playing", video_player->position / 1e9, video_player->duration() / 1e9);
+    return state;
+}
+
+/// `replay` reports on the buffer, `replay show [SECONDS]` plays the last
+/// SECONDS (or all of it) in the window and toggles back, `replay live`
+/// returns to live and `replay dump [PATH]` writes it out in the background.
+static std::string run_replay(std::istringstream &words) {
+    if (!video_replay) {
+        return "error: replay is off, start with --replay SECONDS";
+    }
+    std::string action, argument;
+    words >> action >> argument;
+    if (action.empty()) {
+        return "ok: " + video_replay->status();
+    }
+    if (action == "show" && !std::atomic_load(&replay_viewer)) {
+        double seconds = argument.empty() ? 0 : std::atof(argument.c_str());
+        std::atomic_store(&replay_viewer, std::make_shared<Replay::Viewer>(*video_replay, seconds));
+        return "ok: replaying";
+    }
+    if (action == "show" || action == "live") {
+        std::atomic_store(&replay_viewer, std::shared_ptr<Replay::Viewer>());
+        return "ok: live";
+    }
+    if (action == "dump") {
+        if (argument.empty()) {
+            char name[64];
+            auto now = time(NULL);
+            strftime(name, sizeof name, "replay-%Y%m%d-%H%M%S.uvcr", localtime(&now));
+            argument = name;
+        }
+        replay_dumper->post([argument]() {
+            Trace::nameThread("replay.dump");
+            auto start = Metrics::Clock::now();
+            try {
+                std::string audio;
+                auto frames = video_replay->dump(argument, audio);
+                fprintf(stderr, "Dumped %zu replay frames to %s%s in %.1fms.\n", frames, argument.c_str(),
+                    audio.empty() ? "" : (" and audio to " + audio).c_str(), Metrics::nanosecondsSince(start) / 1e6);
+            } catch (std::runtime_error &error) {
+                fprintf(stderr, "Replay dump failed: %s\n", error.what());
+            }
+        });
+        return "ok: dumping to " + argument;
+    }
+    return "error: expected replay, replay show [SECONDS], replay live or replay dump [PATH]";
+}
+
+/// `deinterlace MODE [double|single]`, where MODE is off, bob, blend,
+/// adaptive or next to cycle through them.
+static std::string run_deinterlace(std::istringstream &words) {
+    std::string name, rate;
+    words >> name >> rate;
+    auto mode = video_deinterlacer->mode.load();
+    if (name == "next") {
+        mode = (Video::Deinterlace)(((int)mode + 1) % 4);
+    } else if (!name.empty() && !Video::deinterlaceByName(name, mode)) {
+        return "error: expected deinterlace off, bob, blend, adaptive or next, optionally followed by double or single";
+    }
+    if (rate == "double" || rate == "single") {
+        video_deinterlacer->doubleRate = rate == "double";
+    } else if (!rate.empty()) {
+        return "error: expected double or single";
+    }
+    video_deinterlacer->mode = mode;
+    return std::string("ok: deinterlace ") + Video::deinterlaceName(mode) + (video_deinterlacer->doubleRate ? " double" : " single");
+}
+
+/// Executes a control command and returns the answer for the client.
+static std::string run_command(VideoStream *stream, std::string line) {
+    std::istringstream words(line);
+    std::string verb;
+    words >> verb;
+
+    if (verb == "trace") {
+        return run_trace(words);
+    }
+    if (verb == "play") {
+        return run_play(words);
+    }
+    if (verb == "deinterlace") {
+        return run_deinterlace(words);
+    }
+    if (verb == "replay") {
+        return run_replay(words);
+    }
+    if (verb == "record") {
+        std::string action, path;
+        words >> action >> path;
+        if (action.empty()) {
+            action = std::atomic_load(&video_recorder) ? "stop" : "start";
+        }
+        if (action == "start") {
+            size_t frameBytes = stream ? stream->mode.width * stream->mode.height * 2 : 0;
+            return start_recording(path, std::max(frameBytes, last_frame_bytes.load()));
+        }
+        if (action == "stop") {
+            return stop_recording();
+        }
+        return "error: expected record, record start [PATH] or record stop";
+    }
+
+    static const std::vector<std::string> videoVerbs = {"mode", "size", "fps", "next", "previous", "modes"};
+    if (!stream && std::find(videoVerbs.begin(), videoVerbs.end(), verb) != videoVerbs.end()) {
+        return "error: video is disabled";
+    }
+
+    auto requested = stream ? stream->mode : UVC::Mode{0, 0, 0};
+    if (verb == "mode") {
+        words >> requested.width >> requested.height;
+        if (!(words >> requested.fps)) {
+            requested.fps = stream->mode.fps;
+        }
+    } else if (verb == "size") {
+        words >> requested.width >> requested.height;
+    } else if (verb == "fps") {
+        words >> requested.fps;
+    } else if (verb == "next") {
+        return stream->cycle(1);
+    } else if (verb == "previous") {
+        return stream->cycle(-1);
+    } else if (verb == "modes") {
+        std::string list = "ok:";
+        for (auto mode: stream->modes) {
+            list += " " + VideoStream::describe(mode);
+        }
+        return list;
+    } else if (verb == "snapshot") {
+        snapshot_requests += snapshot_burst;
+        return "ok";
+    } else if (verb == "scopes") {
+        video_scopes->toggle();
+        return "ok";
+    } else if (verb == "display") {
+        std::string state;
+        words >> state;
+        if (state != "on" && state != "off") {
+            return "error: expected display on or display off";
+        }
+        video_preview->setEnabled(state == "on");
+        return "ok";
+    } else if (verb == "metrics") {
+        Metrics::Registry::shared().print(stderr);
+        return "ok";
+    } else if (verb == "quit") {
+        sem_post(&closingSemaphore);
+        return "ok";
+    } else {
+        return "error: unknown command '" + verb + "'. Try mode, size, fps, next, previous, modes, snapshot, scopes, display, trace, record, play, deinterlace, replay, metrics or quit.";
+    }
+
+    if (requested.width <= 0 || requested.height <= 0 || requested.fps <= 0) {
+        return "error: expected positive numbers";
+    }
+    return stream->change(requested);
+}
+
+Audio::Ring *ring_buffer = NULL;
+static int playback_reader = 0;
+static Metrics::Counter audio_underflows("audio.underflows");
+static Metrics::Counter audio_overflows("audio.overflows");
 
 static void read_callback(struct SoundIoInStream *instream, int frame_count_min, int frame_count_max) {
+    Trace::nameThread("audio in");
+    Trace::Span span("audio.read", frame_count_max);
+
     struct SoundIoChannelArea *areas;
     int err;
-    char *write_ptr = soundio_ring_buffer_write_ptr(ring_buffer);
-    int free_bytes = soundio_ring_buffer_free_count(ring_buffer);
-    int free_count = free_bytes / instream->bytes_per_frame;
+    int free_count = ring_buffer->writable();
 
     if (frame_count_min > free_count) {
-        throw std::runtime_error("Ring buffer overflow"); 
+        // Playback has fallen behind. Throwing here would take the process
+        // down from a realtime thread, so discard this input instead.
+        audio_overflows.add();
+        Trace::instant("audio.overflow", frame_count_min);
+        int frames_left = frame_count_min;
+        while (frames_left > 0) {
+            int frame_count = frames_left;
+            if (soundio_instream_begin_read(instream, &areas, &frame_count) || !frame_count)
+                break;
+            soundio_instream_end_read(instream);
+            frames_left -= frame_count;
+        }
+        return;
     }
 
-    int write_frames = std::min(free_count, frame_count_max);
-    int frames_left = write_frames;
+    int frames_left = std::min(free_count, frame_count_max);
 
     for (;;) {
         int frame_count = frames_left;
@@ -77,20 +617,18 @@ static void read_callback(struct SoundIoInStream *instream, int frame_count_min,
         if (!frame_count)
             break;
 
+        auto spans = ring_buffer->writeSpans(frame_count);
         if (!areas) {
             // Due to an overflow there is a hole. Fill the ring buffer with
             // silence for the size of the hole.
-            memset(write_ptr, 0, frame_count * instream->bytes_per_frame);
+            memset(spans.first.data, 0, spans.first.frames * instream->bytes_per_frame);
+            memset(spans.second.data, 0, spans.second.frames * instream->bytes_per_frame);
             fprintf(stderr, "Dropped %d frames due to internal overflow\n", frame_count);
         } else {
-            for (int frame = 0; frame < frame_count; frame += 1) {
-                for (int ch = 0; ch < instream->layout.channel_count; ch += 1) {
-                    memcpy(write_ptr, areas[ch].ptr, instream->bytes_per_sample);
-                    areas[ch].ptr += areas[ch].step;
-                    write_ptr += instream->bytes_per_sample;
-                }
-            }
+            SoundIO::readAreas(areas, instream->layout.channel_count, instream->bytes_per_sample, spans.first.frames, spans.first.data);
+            SoundIO::readAreas(areas, instream->layout.channel_count, instream->bytes_per_sample, spans.second.frames, spans.second.data);
         }
+        ring_buffer->commitWrite(spans.frames());
 
         if ((err = soundio_instream_end_read(instream))) {
             throw std::runtime_error("End read error."); 
@@ -100,9 +638,6 @@ static void read_callback(struct SoundIoInStream *instream, int frame_count_min,
         if (frames_left <= 0)
             break;
     }
-
-    int advance_bytes = write_frames * instream->bytes_per_frame;
-    soundio_ring_buffer_advance_write_ptr(ring_buffer, advance_bytes);
 }
 
 static void write_callback(struct SoundIoOutStream *outstream, int frame_count_min, int frame_count_max) {
@@ -111,9 +646,11 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
     int frame_count;
     int err;
 
-    char *read_ptr = soundio_ring_buffer_read_ptr(ring_buffer);
-    int fill_bytes = soundio_ring_buffer_fill_count(ring_buffer);
-    int fill_count = fill_bytes / outstream->bytes_per_frame;
+    Trace::nameThread("audio out");
+    Trace::Span span("audio.write", frame_count_max);
+
+    int fill_count = ring_buffer->readable(playback_reader);
+    Trace::counter("audio.ring_fill", fill_count);
 
     if (frame_count_min > fill_count) {
         // Ring buffer does not have enough data, fill with zeroes.
@@ -127,12 +664,7 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
             }
             if (frame_count <= 0)
                 return;
-            for (int frame = 0; frame < frame_count; frame += 1) {
-                for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
-                    memset(areas[ch].ptr, 0, outstream->bytes_per_sample);
-                    areas[ch].ptr += areas[ch].step;
-                }
-            }
+            SoundIO::silenceAreas(areas, outstream->layout.channel_count, outstream->bytes_per_sample, frame_count);
             if ((err = soundio_outstream_end_write(outstream))) {
                 throw std::runtime_error("End write error.");
             }
@@ -140,8 +672,7 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
         }
     }
 
-    int read_count = std::min(frame_count_max, fill_count);
-    frames_left = read_count;
+    frames_left = std::min(frame_count_max, fill_count);
 
     while (frames_left > 0) {
         int frame_count = frames_left;
@@ -153,13 +684,10 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
         if (frame_count <= 0)
             break;
 
-        for (int frame = 0; frame < frame_count; frame += 1) {
-            for (int ch = 0; ch < outstream->layout.channel_count; ch += 1) {
-                memcpy(areas[ch].ptr, read_ptr, outstream->bytes_per_sample);
-                areas[ch].ptr += areas[ch].step;
-                read_ptr += outstream->bytes_per_sample;
-            }
-        }
+        auto spans = ring_buffer->readSpans(playback_reader, frame_count);
+        SoundIO::writeAreas(areas, outstream->layout.channel_count, outstream->bytes_per_sample, spans.first.frames, spans.first.data);
+        SoundIO::writeAreas(areas, outstream->layout.channel_count, outstream->bytes_per_sample, spans.second.frames, spans.second.data);
+        ring_buffer->commitRead(playback_reader, spans.frames());
 
         if ((err = soundio_outstream_end_write(outstream))) {
             throw std::runtime_error("End write error.");
@@ -167,13 +695,129 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
 
         frames_left -= frame_count;
     }
-
-    soundio_ring_buffer_advance_read_ptr(ring_buffer, read_count * outstream->bytes_per_frame);
 }
 
 static void underflow_callback(struct SoundIoOutStream *outstream) {
-    static int count = 0;
-    fprintf(stderr, "Audio Underflow %d\r", ++count);
+    audio_underflows.add();
+    Trace::instant("audio.underflow");
+    fprintf(stderr, "Audio Underflow %llu\r", (unsigned long long)audio_underflows.value.load());
+}
+
+/// The capture to playback audio path: the ring and both streams feeding it.
+/// Members are destroyed in reverse, so the streams stop before the ring goes.
+struct Loopback {
+    SoundIO::Format format;
+    int sampleRate;
+    Audio::Ring ring;
+    SoundIO::InStream instream;
+    SoundIO::OutStream outstream;
+
+    // Room for twice the latency, pre-filled with the latency's worth of
+    // silence so playback starts that far behind capture.
+    Loopback(SoundIO::Device &in, SoundIO::Device &out, SoundIO::Format format, int sampleRate, const SoundIO::Layout &layout, double latency):
+        format(format),
+        sampleRate(sampleRate),
+        ring(2 * latency * sampleRate, soundio_get_bytes_per_sample(format) * layout.channel_count),
+        instream(in.createInStream(format, sampleRate, layout, latency, read_callback)),
+        outstream(out.createOutStream(format, sampleRate, layout, latency, write_callback, underflow_callback)) {
+        ring_buffer = &ring;
+        playback_reader = ring.addReader();
+        ring.writeSilence(latency * sampleRate);
+    }
+
+    void start() {
+        instream.start();
+        outstream.start();
+    }
+};
+
+/// Prints what the backend actually gave us against what was asked for.
+static void report_audio_latency(SoundIO::Context &context, SoundIO::Device &in, SoundIO::Device &out, Loopback &loopback, double requested) {
+    fprintf(stderr, "Audio backend %s: requested %.2fms, input got %.2fms (allows %.2f-%.2fms), output got %.2fms (allows %.2f-%.2fms).\n",
+        SoundIO::Context::backendName(context.currentBackend()).c_str(),
+        requested * 1e3,
+        loopback.instream.getSoftwareLatency() * 1e3,
+        in.getMinimumLatency() * 1e3,
+        in.getMaximumLatency() * 1e3,
+        loopback.outstream.getSoftwareLatency() * 1e3,
+        out.getMinimumLatency() * 1e3,
+        out.getMaximumLatency() * 1e3
+    );
+
+    auto inLatency = loopback.instream.getLatency();
+    auto outLatency = loopback.outstream.getLatency();
+    if (inLatency.has_value() && outLatency.has_value()) {
+        fprintf(stderr, "Stream latency right now: input %.2fms, output %.2fms, plus %.2fms in the ring.\n",
+            inLatency.value() * 1e3, outLatency.value() * 1e3, requested * 1e3);
+    }
+}
+
+/// Plays MLS bursts out of `out` and listens for them on `in`, which must be
+/// looped back to it. Returns the measurement; streams are torn down before.
+static Calibration::Result measure_round_trip(SoundIO::Context &context, SoundIO::Device &in, SoundIO::Device &out, SoundIO::Format format, int sampleRate, const SoundIO::Layout &layout, double latency) {
+    Calibration::Probe probe(format, sampleRate);
+    {
+        auto instream = in.createInStream(format, sampleRate, layout, latency, Calibration::Probe::readCallback);
+        auto outstream = out.createOutStream(format, sampleRate, layout, latency, Calibration::Probe::writeCallback, underflow_callback);
+        instream.internal->userdata = &probe;
+        outstream.internal->userdata = &probe;
+        instream.start(); outstream.start();
+
+        auto deadline = probe.seconds() + 2.0 * probe.captured.size() / sampleRate + 2;
+        while (!probe.done() && probe.seconds() < deadline) {
+            context.flushEvents();
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+    return probe.analyze();
+}
+
+/// Finds the smallest software latency that survives `soakSeconds` of
+/// loopback without underflow, then measures the round trip at that setting.
+static double calibrate_latency(SoundIO::Context &context, SoundIO::Device &in, SoundIO::Device &out, SoundIO::Format format, int sampleRate, const SoundIO::Layout &layout, double fallback, int soakSeconds) {
+    static const double candidates[] = {0.005, 0.01, 0.015, 0.02, 0.03, 0.04, 0.05, 0.075, 0.1, 0.15, 0.2};
+
+    std::cerr << "Calibrating audio latency, " << soakSeconds << "s per setting..." << std::endl;
+    double recommended = -1;
+    for (auto candidate: candidates) {
+        auto underflows = audio_underflows.value.load();
+        auto overflows = audio_overflows.value.load();
+        {
+            Loopback loopback(in, out, format, sampleRate, layout, candidate);
+            loopback.start();
+            for (int i = 0; i < soakSeconds * 10; i += 1) {
+                context.flushEvents();
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        }
+        auto dropped = audio_underflows.value.load() - underflows + audio_overflows.value.load() - overflows;
+        fprintf(stderr, "\n  %.3fs: %llu underflows/overflows\n", candidate, (unsigned long long)dropped);
+        if (!dropped) {
+            recommended = candidate;
+            break;
+        }
+    }
+    if (recommended < 0) {
+        std::cerr << "No setting ran cleanly, keeping " << fallback << "s." << std::endl;
+        recommended = fallback;
+    }
+
+    if (!Calibration::supportsFormat(format)) {
+        std::cerr << "Skipping round trip measurement: format " << SoundIO::Context::formatName(format) << " isn't supported by the probe." << std::endl;
+    } else {
+        std::cerr << "Measuring round trip: the output should be looped back into the input." << std::endl;
+        auto result = measure_round_trip(context, in, out, format, sampleRate, layout, recommended);
+        if (result.latencies.empty()) {
+            std::cerr << "Test signal not detected on the input. Is the loopback connected?" << std::endl;
+        } else {
+            fprintf(stderr, "Round trip: %.2fms, jitter %.2fms (%zu/%d bursts detected, callback jitter %.2fms)\n",
+                result.mean * 1e3, result.jitter * 1e3, result.latencies.size(), result.bursts, result.callbackJitter * 1e3);
+            fprintf(stderr, "Capture to playback with the ring pre-fill: ~%.2fms\n", (result.mean + recommended) * 1e3);
+        }
+    }
+
+    fprintf(stderr, "Recommended: --audio_latency %g (applied)\n", recommended);
+    return recommended;
 }
 
 struct RAIIFile {
@@ -193,33 +837,54 @@ int main(int argc, char** argv) {
     SSCO::Options ssco({
         {"version", 'v', "Show the current version of this app.", false, [&](){std::cout << "0.1.0" << std::endl; exit(0);}},
         {"help", 'h', "Show this message and exit.", false, [&](){ ssco.printHelp(std::cout); exit(0); }},
-        {"list_sound", std::nullopt, "List sound devices and exit.", false, [&](){
-            auto sioContext = SoundIO::Context();
-
-            std::cout << "Inputs" << std::endl;
-            for (auto i = 0; i < sioContext.inputDeviceCount(); i += 1) {
-                auto device = sioContext.inputDeviceByIndex(i);
-                std::cout << i << ": " << device.getID() << " :: " << device.getName() << std::endl;
-            }
-            std::cout << "Outputs" << std::endl;
-            for (auto i = 0; i < sioContext.outputDeviceCount(); i += 1) {
-                auto device = sioContext.outputDeviceByIndex(i);
-                std::cout << i << ": " << device.getID() << " :: " << device.getName() << std::endl;
-            }
-            exit(0);
-        }},
+        {"list_sound", std::nullopt, "List sound devices (of --audio_backend, if given) and exit.", false, std::nullopt},
+        {"list_backends", std::nullopt, "List the sound backends this libsoundio was built with and exit.", false, std::nullopt},
         {"diagnostic_data", 'd', "File to store diagnostic data in (optional).", true, std::nullopt},
 
         {"audio_in", 'i', "ID of audio device to use as an input.", true, std::nullopt},
         {"audio_out", 'o', "ID of audio device to use as an output.", true, std::nullopt},
         {"audio_latency", 'l', "Floating point value determining software audio latency in seconds. [Default: 0.05s]", true, std::nullopt},
+        {"audio_backend", 'b', "Sound backend: " + SoundIO::Context::backendChoices() + ". [Default: libsoundio's choice]", true, std::nullopt},
+        {"audio_period", std::nullopt, "Period size in frames. Sets the software latency to period x periods, overriding --audio_latency.", true, std::nullopt},
+        {"audio_periods", std::nullopt, "Number of periods to buffer when --audio_period is given. [Default: 2]", true, std::nullopt},
+
+        {"calibrate_latency", std::nullopt, "Find and apply the smallest audio latency that runs without underflows, and measure the round trip through a loopback.", false, std::nullopt},
+        {"calibrate_seconds", std::nullopt, "How long each latency is tested for during calibration. [Default: 5]", true, std::nullopt},
 
         {"video_width", 'w', "Video width. [Default: 1280]", true, std::nullopt},
         {"video_height", 'h', "Video height. [Default: 720]", true, std::nullopt},
         {"video_framerate", 'f', "Video fremerate. [Default: 60]", true, std::nullopt},
+        {"control_socket", std::nullopt, "Unix socket to accept commands on, one per line (e.g. \"mode 1920 1080 30\"). The 'm'/'M' keys cycle through the device's modes.", true, std::nullopt},
+
+        {"headless", std::nullopt, "Don't open a preview window. Frames are only processed for snapshots and other consumers.", false, std::nullopt},
+        {"no_static_skip", std::nullopt, "Convert and redraw every frame, even if it is identical to the previous one.", false, std::nullopt},
+        {"metrics_interval", std::nullopt, "Print metrics to stderr every this many seconds. [Default: only on exit]", true, std::nullopt},
+
+        {"scopes", std::nullopt, "Show histogram, waveform and vectorscope overlays. Toggle with the 'c' key.", false, std::nullopt},
+        {"scopes_interval", std::nullopt, "Update the scopes every this many frames. [Default: 4]", true, std::nullopt},
+        {"scopes_threads", std::nullopt, "Threads to compute the scopes with. [Default: 2]", true, std::nullopt},
+
+        {"snapshot_dir", std::nullopt, "Directory to save snapshots to. Snapshots are taken with the 's' key or SIGUSR1. [Default: .]", true, std::nullopt},
+        {"snapshot_format", std::nullopt, "Snapshot image format: png or jpg. [Default: png]", true, std::nullopt},
+        {"snapshot_burst", std::nullopt, "Number of consecutive frames saved per snapshot. [Default: 1]", true, std::nullopt},
 
-        // {"no_audio", 'A', "Disable audio loopback.", false, std::nullopt },
-        // {"no_video", 'V', "Disable video loopback.", false, std::nullopt }
+        {"deinterlace", std::nullopt, "Deinterlace the preview: off, bob, blend or adaptive. Cycle with the 'i' key. [Default: off]", true, std::nullopt},
+        {"deinterlace_double", std::nullopt, "Show one frame per field (bob and adaptive only), doubling the frame rate.", false, std::nullopt},
+        {"field_order", std::nullopt, "Which field comes first in time: tff or bff. [Default: tff]", true, std::nullopt},
+        {"deinterlace_threads", std::nullopt, "Threads to deinterlace with, the capture thread included. [Default: 2]", true, std::nullopt},
+
+        {"record", std::nullopt, "Record losslessly compressed video to this file. Toggle recording with the 'r' key.", true, std::nullopt},
+        {"record_threads", std::nullopt, "Threads compressing recorded frames, or decoding them for --play. [Default: half the cores]", true, std::nullopt},
+        {"play", std::nullopt, "Play a recording instead of opening the camera. Space pauses, [ and ] seek 5s.", true, std::nullopt},
+
+        {"replay", std::nullopt, "Keep the last this many seconds of video and audio in memory. 'p' replays them, 'd' dumps them to disk.", true, std::nullopt},
+        {"replay_memory", std::nullopt, "Memory the replay buffer may use in total, in MB. [Default: enough for the seconds at the current mode, up to a quarter of RAM]", true, std::nullopt},
+
+        {"trace", std::nullopt, "Start recording a trace timeline right away. Toggle with the 't' key or SIGUSR2.", false, std::nullopt},
+        {"trace_file", std::nullopt, "Where traces are dumped, as Chrome trace JSON. [Default: uvc-trace.json]", true, std::nullopt},
+
+        {"no_audio", 'A', "Disable audio loopback.", false, std::nullopt },
+        {"no_video", 'V', "Disable video loopback.", false, std::nullopt }
     });
 
     auto opts = ssco.process(argc, argv);
@@ -237,13 +902,59 @@ int main(int argc, char** argv) {
         diagnosticDataFile.f = fopen(options["diagonstic_data"].c_str(), "w");
     } 
 
-    auto sioContext = SoundIO::Context();
-    int audioInIndex = sioContext.defaultInputIndex();
+    std::optional<SoundIoBackend> backend;
+    if (options.find("audio_backend") != options.end()) {
+        backend = SoundIO::Context::backendByName(options["audio_backend"]);
+        if (!backend.has_value()) {
+            std::cerr << "Unknown sound backend '" << options["audio_backend"] << "'." << std::endl;
+            return 64;
+        }
+    }
+
+    auto audio = true;
+    if (options.find("no_audio") != options.end()) {
+        std::cerr << "Audio loopback disabled." << std::endl;
+        audio = false;
+    }
+
+    // Only touch the sound server if audio is actually wanted, so --no_audio
+    // works on hosts without any sound devices.
+    auto listBackends = options.find("list_backends") != options.end();
+    auto listSound = options.find("list_sound") != options.end();
+    std::unique_ptr<SoundIO::Context> sioContext;
+    if (audio || listBackends || listSound) {
+        sioContext.reset(new SoundIO::Context(backend));
+    }
+
+    if (listBackends) {
+        for (auto available: sioContext->availableBackends()) {
+            std::cout << SoundIO::Context::backendName(available) << std::endl;
+        }
+        return 0;
+    }
+
+    if (listSound) {
+        std::cout << "Backend: " << SoundIO::Context::backendName(sioContext->currentBackend()) << std::endl;
+        std::cout << "Inputs" << std::endl;
+        for (auto i = 0; i < sioContext->inputDeviceCount(); i += 1) {
+            auto device = sioContext->inputDeviceByIndex(i);
+            std::cout << i << ": " << device.getID() << " :: " << device.getName() << std::endl;
+        }
+        std::cout << "Outputs" << std::endl;
+        for (auto i = 0; i < sioContext->outputDeviceCount(); i += 1) {
+            auto device = sioContext->outputDeviceByIndex(i);
+            std::cout << i << ": " << device.getID() << " :: " << device.getName() << std::endl;
+        }
+        return 0;
+    }
+
+    // Defaults are resolved once audio is set up.
+    int audioInIndex = -1;
     if (options.find("audio_in") != options.end()) {
         audioInIndex = std::atoi(options["audio_in"].c_str());
     }
 
-    int audioOutIndex = sioContext.defaultOutputIndex();
+    int audioOutIndex = -1;
     if (options.find("audio_out") != options.end()) {
         audioOutIndex = std::atoi(options["audio_out"].c_str());
     }
@@ -253,6 +964,26 @@ int main(int argc, char** argv) {
         latency = std::atof(options["audio_latency"].c_str());
     }
 
+    auto period = 0;
+    if (options.find("audio_period") != options.end()) {
+        period = std::atoi(options["audio_period"].c_str());
+    }
+
+    auto periods = 2;
+    if (options.find("audio_periods") != options.end()) {
+        periods = std::max(1, std::atoi(options["audio_periods"].c_str()));
+    }
+
+    auto calibrate = false;
+    if (options.find("calibrate_latency") != options.end()) {
+        calibrate = true;
+    }
+
+    auto calibrateSeconds = 5;
+    if (options.find("calibrate_seconds") != options.end()) {
+        calibrateSeconds = std::max(1, std::atoi(options["calibrate_seconds"].c_str()));
+    }
+
     auto width = 1280;
     if (options.find("video_width") != options.end()) {
         width = std::atoi(options["video_width"].c_str());
@@ -264,14 +995,109 @@ int main(int argc, char** argv) {
     }
 
     auto fps = 60;
-    if (options.find("fps") != options.end()) {
-        fps = std::atoi(options["fps"].c_str());
+    if (options.find("video_framerate") != options.end()) {
+        fps = std::atoi(options["video_framerate"].c_str());
     }
 
-    auto audio = true;
-    if (options.find("no_audio") != options.end()) {
-        std::cerr << "Audio loopback disabled." << std::endl;
-        audio = false;
+    auto scopes = false;
+    if (options.find("scopes") != options.end()) {
+        scopes = true;
+    }
+
+    auto scopesInterval = 4;
+    if (options.find("scopes_interval") != options.end()) {
+        scopesInterval = std::atoi(options["scopes_interval"].c_str());
+    }
+
+    auto scopesThreads = 2;
+    if (options.find("scopes_threads") != options.end()) {
+        scopesThreads = std::max(1, std::atoi(options["scopes_threads"].c_str()));
+    }
+
+    std::string snapshotDir = ".";
+    if (options.find("snapshot_dir") != options.end()) {
+        snapshotDir = options["snapshot_dir"];
+    }
+
+    std::string snapshotFormat = "png";
+    if (options.find("snapshot_format") != options.end()) {
+        snapshotFormat = options["snapshot_format"];
+    }
+
+    if (options.find("snapshot_burst") != options.end()) {
+        snapshot_burst = std::max(1, std::atoi(options["snapshot_burst"].c_str()));
+    }
+
+    auto deinterlace = Video::Deinterlace::Off;
+    if (options.find("deinterlace") != options.end() && !Video::deinterlaceByName(options["deinterlace"], deinterlace)) {
+        std::cerr << "Unknown deinterlace mode '" << options["deinterlace"] << "'." << std::endl;
+        return 64;
+    }
+
+    auto topFieldFirst = true;
+    if (options.find("field_order") != options.end()) {
+        if (options["field_order"] != "tff" && options["field_order"] != "bff") {
+            std::cerr << "Field order must be tff or bff." << std::endl;
+            return 64;
+        }
+        topFieldFirst = options["field_order"] == "tff";
+    }
+
+    auto deinterlaceThreads = 2;
+    if (options.find("deinterlace_threads") != options.end()) {
+        deinterlaceThreads = std::max(1, std::atoi(options["deinterlace_threads"].c_str()));
+    }
+
+    record_threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+    if (options.find("record_threads") != options.end()) {
+        record_threads = std::max(1, std::atoi(options["record_threads"].c_str()));
+    }
+
+    std::string recordFile, playFile;
+    if (options.find("record") != options.end()) {
+        recordFile = options["record"];
+    }
+    if (options.find("play") != options.end()) {
+        playFile = options["play"];
+    }
+
+    double replaySeconds = 0;
+    if (options.find("replay") != options.end()) {
+        replaySeconds = std::atof(options["replay"].c_str());
+    }
+
+    size_t replayMemory = 0;
+    if (options.find("replay_memory") != options.end()) {
+        replayMemory = std::max(1, std::atoi(options["replay_memory"].c_str()));
+    }
+
+    if (options.find("trace_file") != options.end()) {
+        trace_file = options["trace_file"];
+    }
+
+    if (options.find("trace") != options.end()) {
+        Trace::start();
+    }
+    signal(SIGUSR2, traceSignalHandler);
+
+    std::string controlSocket;
+    if (options.find("control_socket") != options.end()) {
+        controlSocket = options["control_socket"];
+    }
+
+    auto headless = false;
+    if (options.find("headless") != options.end()) {
+        headless = true;
+    }
+
+    auto skipStatic = true;
+    if (options.find("no_static_skip") != options.end()) {
+        skipStatic = false;
+    }
+
+    auto metricsInterval = 0;
+    if (options.find("metrics_interval") != options.end()) {
+        metricsInterval = std::atoi(options["metrics_interval"].c_str());
     }
 
     auto video = true;
@@ -281,9 +1107,16 @@ int main(int argc, char** argv) {
     }
 
     // Audio
-    // if (audio) {
-        auto audioInDevice = sioContext.inputDeviceByIndex(audioInIndex);
-        auto audioOutDevice = sioContext.outputDeviceByIndex(audioOutIndex);
+    std::unique_ptr<Loopback> loopback;
+    if (audio) {
+        if (audioInIndex < 0) {
+            audioInIndex = sioContext->defaultInputIndex();
+        }
+        if (audioOutIndex < 0) {
+            audioOutIndex = sioContext->defaultOutputIndex();
+        }
+        auto audioInDevice = sioContext->inputDeviceByIndex(audioInIndex);
+        auto audioOutDevice = sioContext->outputDeviceByIndex(audioOutIndex);
 
         auto layout = audioOutDevice.getBestLayout(audioInDevice);
         auto sampleRate = audioOutDevice.getBestSampleRate(audioInDevice, {
@@ -319,29 +1152,182 @@ int main(int argc, char** argv) {
         std::cerr << "Routing audio from " << audioInDevice.getName() << " to " << audioOutDevice.getName() << "..." << std::endl;
         std::cerr << "Running sample rate " << sampleRate << " with format " << SoundIO::Context::formatName(format) << "." << std::endl;
 
-        auto instream = audioInDevice.createInStream(format, sampleRate, *layout, latency, read_callback);
-        auto outstream = audioOutDevice.createOutStream(format, sampleRate, *layout, latency, write_callback, underflow_callback);
+        if (period > 0) {
+            latency = (double)period * periods / sampleRate;
+            fprintf(stderr, "Requested %d periods of %d frames (%.2fms).\n", periods, period, latency * 1e3);
+        }
 
-        sioContext.prepareGlobalBuffer(ring_buffer, instream, outstream, latency);
+        if (calibrate) {
+            latency = calibrate_latency(*sioContext, audioInDevice, audioOutDevice, format, sampleRate, *layout, latency, calibrateSeconds);
+        }
 
-        instream.start(); outstream.start();
-        sioContext.flushEvents();
-    // }
+        loopback.reset(new Loopback(audioInDevice, audioOutDevice, format, sampleRate, *layout, latency));
+        loopback->start();
+        sioContext->flushEvents();
+        report_audio_latency(*sioContext, audioInDevice, audioOutDevice, *loopback, latency);
+    }
     
+    // Snapshots
+    // Declared before the UVC handle so they outlive the stream.
+    auto snapshotPool = Video::FramePool(snapshot_burst + 2, width * height * 2);
+    auto snapshotWriter = Snapshot::Writer(snapshotDir, snapshotFormat);
+    snapshot_pool = &snapshotPool;
+    snapshot_writer = &snapshotWriter;
+    signal(SIGUSR1, snapshotSignalHandler);
+
     // Video
-    // if (video) {
-        auto uvcContext = UVC::Context();
+    // The preview and scopes exist either way so keys and commands always
+    // have something to talk to; with --no_video they just never see frames.
+    auto preview = Video::Preview(video_demand, "UVC Viewer", skipStatic, headless || (!video && playFile.empty()));
+    video_preview = &preview;
+
+    auto deinterlacer = Video::Deinterlacer(deinterlace, options.find("deinterlace_double") != options.end(), topFieldFirst, deinterlaceThreads);
+    video_deinterlacer = &deinterlacer;
+
+    auto scopesOverlay = Scopes::Overlay(width * height * 2, scopesInterval, scopes, scopesThreads);
+    video_scopes = &scopesOverlay;
+    preview.addOverlay(&scopesOverlay);
+
+    if (!recordFile.empty()) {
+        std::cerr << start_recording(recordFile, width * height * 2) << std::endl;
+    }
+
+    std::unique_ptr<Capture> capture;
+    std::unique_ptr<VideoStream> videoStream;
+    std::unique_ptr<Record::Reader> playback;
+    std::unique_ptr<Record::Player> player;
+    if (!playFile.empty()) {
+        playback.reset(new Record::Reader(playFile));
+        if (playback->rebuilt) {
+            std::cerr << playFile << " has no index, probably because recording was interrupted; rebuilt it from the frames." << std::endl;
+        }
+    } else if (video) {
         std::cerr << "Searching for video devices..." << std::endl;
-        auto uvcDevice = uvcContext.getDevice();
-        auto uvcHandle = uvcDevice.getHandle();
-        if (diagnosticDataFile.f) uvcHandle.printDiagnostics(diagnosticDataFile.f);
+        capture.reset(new Capture());
+        if (diagnosticDataFile.f) capture->handle.printDiagnostics(diagnosticDataFile.f);
 
-        auto control = uvcHandle.getControl(UVC_FRAME_FORMAT_YUYV, width, height, fps);
-        if (diagnosticDataFile.f) control.printData(diagnosticDataFile.f);
+        videoStream.reset(new VideoStream(capture->handle, diagnosticDataFile.f));
+    }
 
-        uvcHandle.start(control, video_callback);
-    // }
+    // Replay
+    // Slots sized up front for the largest frame the source can switch to,
+    // and in place before the first frame arrives. The budget follows the
+    // mode from then on. Dumps drain before it goes.
+    std::unique_ptr<Replay::Buffer> replay;
+    Async::Worker replayDumper;
+    if (replaySeconds > 0) {
+        UVC::Mode started = {width, height, fps};
+        std::vector<UVC::Mode> modes;
+        if (videoStream) {
+            modes = videoStream->modes;
+        }
+        Record::FrameHeader first;
+        std::vector<uint8_t> scratch;
+        if (playback && playback->read(0, first, scratch)) {
+            started = {(int)first.width, (int)first.height, fps};
+        }
+        modes.push_back(started);
 
-    // Wait on close semaphore
-    sem_wait(&closingSemaphore);
+        size_t frameBytes = 0;
+        for (auto mode: modes) {
+            frameBytes = std::max<size_t>(frameBytes, mode.width * mode.height * 2);
+        }
+        if (playback) {
+            frameBytes = std::max<size_t>(frameBytes, first.rawBytes);
+        }
+        size_t audioBytes = loopback ? Replay::AudioTrack::memoryFor(loopback->ring, loopback->sampleRate, replaySeconds) : 0;
+        size_t physical = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+        replay_sizing = {replaySeconds, frameBytes, audioBytes, replayMemory * 1000000, physical / 4};
+
+        size_t most = 0;
+        for (auto mode: modes) {
+            most = std::max(most, replay_sizing.budget(mode));
+        }
+        auto wanted = replay_sizing.wanted(started);
+        if (replay_sizing.fixed > physical) {
+            fprintf(stderr, "--replay_memory %zu MB is more than this machine has (%zu MB).\n", replayMemory, physical / 1000000);
+            return 64;
+        } else if (replay_sizing.fixed > replay_sizing.cap) {
+            fprintf(stderr, "Warning: --replay_memory %zu MB is over a quarter of this machine's %zu MB.\n", replayMemory, physical / 1000000);
+        } else if (replay_sizing.budget(started) < wanted) {
+            fprintf(stderr, "Warning: %.0fs at %s likely needs about %zu MB of replay memory, so it will hold less with %zu MB.\n",
+                    replaySeconds, VideoStream::describe(started).c_str(), (wanted + 999999) / 1000000, replay_sizing.budget(started) / 1000000);
+        }
+        try {
+            replay.reset(new Replay::Buffer(video_demand, replaySeconds, replay_sizing.budget(started), frameBytes, audioBytes, most));
+        } catch (std::runtime_error &error) {
+            std::cerr << error.what() << std::endl;
+            return 64;
+        }
+        if (loopback) {
+            auto channels = loopback->ring.frameBytes() / soundio_get_bytes_per_sample(loopback->format);
+            replay->addAudio(loopback->ring, loopback->format, loopback->sampleRate, channels);
+            uint16_t tag, bits;
+            if (!Replay::AudioTrack::wavFormat(loopback->format, tag, bits)) {
+                std::cerr << "Replay dumps will have no audio: " << SoundIO::Context::formatName(loopback->format) << " has no WAV equivalent." << std::endl;
+            }
+        }
+        video_replay = replay.get();
+        replay_dumper = &replayDumper;
+        fprintf(stderr, "Keeping the last %.0fs in %zu MB for replay (up to %zu MB in other modes).\n",
+                replaySeconds, replay_sizing.budget(started) / 1000000, most / 1000000);
+    }
+
+    if (playback) {
+        player.reset(new Record::Player(*playback, [](uvc_frame_t *frame) { video_callback(frame, NULL); }, record_threads));
+        video_player = player.get();
+        fprintf(stderr, "Playing %zu frames (%.2fs) from %s.\n", playback->count(), player->duration() / 1e9, playFile.c_str());
+    } else if (videoStream) {
+        videoStream->start({width, height, fps});
+    }
+
+    std::unique_ptr<Control::SocketServer> controlServer;
+    if (!controlSocket.empty()) {
+        controlServer.reset(new Control::SocketServer(control_channel, controlSocket));
+        std::cerr << "Accepting commands on " << controlSocket << "." << std::endl;
+    }
+
+    // Run commands until the close semaphore is posted
+    auto lastMetrics = Metrics::Clock::now();
+    while (sem_trywait(&closingSemaphore) != 0) {
+        for (; trace_toggles > 0; trace_toggles -= 1) {
+            control_channel.post("trace");
+        }
+        auto command = control_channel.next(std::chrono::milliseconds(100));
+        if (command.has_value()) {
+            auto answer = run_command(videoStream.get(), command->line);
+            std::cerr << answer << std::endl;
+            command->respond(answer);
+        }
+        if (metricsInterval > 0 && Metrics::nanosecondsSince(lastMetrics) >= metricsInterval * 1000000000ull) {
+            Metrics::Registry::shared().print(stderr);
+            lastMetrics = Metrics::Clock::now();
+        }
+    }
+
+    controlServer.reset();
+    video_player = NULL;
+    player.reset();
+    if (capture) capture->handle.endStream();
+    // A doubled field may still be queued to show out of the deinterlacer.
+    preview.settle();
+    std::atomic_store(&replay_viewer, std::shared_ptr<Replay::Viewer>());
+    if (replay) {
+        std::cerr << "Replay: " << replay->status() << std::endl;
+        if (replayDumper.pending()) {
+            std::cerr << "Waiting for the replay dump to finish..." << std::endl;
+        }
+    }
+    if (std::atomic_load(&video_recorder)) {
+        std::cerr << stop_recording() << std::endl;
+    }
+    if (Trace::enabled()) {
+        std::istringstream off("off");
+        std::cerr << run_trace(off) << std::endl;
+    }
+    snapshot_writer = NULL;
+    if (snapshotWriter.pending()) {
+        std::cerr << "Waiting for " << snapshotWriter.pending() << " snapshot(s) to finish encoding..." << std::endl;
+    }
+    Metrics::Registry::shared().print(stderr);
 }
\ No newline at end of file